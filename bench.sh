@@ -0,0 +1,192 @@
+#!/bin/bash
+# Tracing-overhead benchmark: runs process_tree under CFS, under the
+# scheduler with tracing off, and under each tracing mode, then writes a
+# CSV of every run plus a JSON summary with per-mode means.
+#
+# Usage: sudo ./bench.sh   (or: sudo make bench)
+#
+# Environment:
+#   BENCH_CPU       CPU for dumper and workload       (default: 1)
+#   BENCH_DURATION  seconds per run                   (default: 10)
+#   BENCH_REPS      repetitions per mode              (default: 3)
+#   BENCH_MODES     modes to run                      (default: "cfs off lockstep sample")
+#   BENCH_SAMPLE_RATE  1-in-N rate for sample mode    (default: 10)
+#   BENCH_LOADER_ARGS  extra scx_loader options, e.g. "-q -F" (default: none)
+#   BENCH_OUT       output directory                  (default: bench_results)
+
+set -u
+
+BUILD_DIR=${BUILD_DIR:-build}
+CPU=${BENCH_CPU:-1}
+DURATION=${BENCH_DURATION:-10}
+REPS=${BENCH_REPS:-3}
+MODES=${BENCH_MODES:-"cfs off lockstep sample"}
+SAMPLE_RATE=${BENCH_SAMPLE_RATE:-10}
+LOADER_ARGS=${BENCH_LOADER_ARGS:-}
+OUT=${BENCH_OUT:-bench_results}
+
+LOADER=$(realpath "$BUILD_DIR/scx_loader")
+RUNNER=$(realpath "$BUILD_DIR/scx_run")
+TREE=$(realpath "$BUILD_DIR/process_tree")
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "bench.sh must run as root (loads a BPF scheduler)" >&2
+    exit 1
+fi
+
+for bin in "$LOADER" "$RUNNER" "$TREE"; do
+    if [ ! -x "$bin" ]; then
+        echo "Missing $bin - run 'make' first" >&2
+        exit 1
+    fi
+done
+
+if [ "$(cat /sys/kernel/sched_ext/state 2>/dev/null)" = "enabled" ]; then
+    echo "A sched_ext scheduler is already loaded; unload it first" >&2
+    exit 1
+fi
+
+mkdir -p "$OUT"
+CSV="$OUT/results.csv"
+JSON="$OUT/summary.json"
+
+echo "mode,rep,elapsed_s,iterations,iter_per_s,switches,switches_per_s,dumper_cpu_s,y_records,y_matched,verify,gate_idle_s" > "$CSV"
+
+# Wait until the scheduler reports enabled (and the dumper had a moment to register)
+wait_for_scx() {
+    for _ in $(seq 50); do
+        if [ "$(cat /sys/kernel/sched_ext/state 2>/dev/null)" = "enabled" ]; then
+            sleep 0.5
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+wait_for_unload() {
+    for _ in $(seq 50); do
+        if [ "$(cat /sys/kernel/sched_ext/state 2>/dev/null)" != "enabled" ]; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    return 1
+}
+
+# Count how many Y entries appear in X in order (Y must be a subsequence of X)
+verify_xy() {
+    awk 'NR == FNR { x[NR] = $2 " " $3; nx = NR; next }
+         { y = $2 " " $3
+           while (i < nx) { i++; if (x[i] == y) { m++; next } }
+         }
+         END { print m + 0 }' "$1" "$2"
+}
+
+# Extract the value after "<label>:" from a log
+field() {
+    grep -m1 "$1:" "$2" | sed "s/.*$1: *//" | awk '{print $1}'
+}
+
+run_one() {
+    local mode=$1 rep=$2
+    local dir="$OUT/$mode-$rep"
+    local loader_pid=""
+
+    mkdir -p "$dir"
+    rm -f "$dir/X.txt" "$dir/Y.txt"
+
+    if [ "$mode" != "cfs" ]; then
+        local extra="$LOADER_ARGS"
+        [ "$mode" = "sample" ] && extra="$extra -n $SAMPLE_RATE"
+        (cd "$dir" && exec "$LOADER" -c "$CPU" -m "$mode" $extra) > "$dir/loader.log" 2>&1 &
+        loader_pid=$!
+        if ! wait_for_scx; then
+            echo "  scheduler failed to load, see $dir/loader.log" >&2
+            kill -INT "$loader_pid" 2>/dev/null
+            wait "$loader_pid"
+            return 1
+        fi
+        (cd "$dir" && exec "$RUNNER" taskset -c "$CPU" "$TREE" --duration "$DURATION") \
+            > "$dir/tree.log" 2>&1
+        kill -INT "$loader_pid"
+        wait "$loader_pid"
+        wait_for_unload
+    else
+        (cd "$dir" && exec taskset -c "$CPU" "$TREE" --duration "$DURATION") \
+            > "$dir/tree.log" 2>&1
+    fi
+
+    local elapsed iters switches dumper_cpu gate_idle y_records y_matched verify
+    elapsed=$(field "Elapsed" "$dir/tree.log")
+    iters=$(field "Worker iterations" "$dir/tree.log")
+    switches=""     # CFS runs have no switch counter
+    dumper_cpu=0
+    gate_idle=0
+    if [ -n "$loader_pid" ]; then
+        switches=$(field "Switch-outs (all tasks)" "$dir/loader.log")
+        dumper_cpu=$(field "Dumper CPU time" "$dir/loader.log")
+        gate_idle=$(field "Gate idle (all CPUs)" "$dir/loader.log")
+    fi
+
+    y_records=$(wc -l < "$dir/Y.txt" 2>/dev/null || echo 0)
+    y_matched=""
+    verify="n/a"
+    # Sampled traces are incomplete by design, Y is not a subsequence of X
+    if [ "$mode" != "sample" ] && [ -s "$dir/X.txt" ] && [ -s "$dir/Y.txt" ]; then
+        y_matched=$(verify_xy "$dir/X.txt" "$dir/Y.txt")
+        if [ "$y_matched" -eq "$y_records" ]; then
+            verify="pass"
+        else
+            verify="fail"
+        fi
+    fi
+
+    awk -v m="$mode" -v r="$rep" -v e="${elapsed:-0}" -v it="${iters:-0}" \
+        -v sw="$switches" -v d="${dumper_cpu:-0}" -v yr="$y_records" \
+        -v ym="$y_matched" -v v="$verify" -v g="${gate_idle:-0}" 'BEGIN {
+            ips = (e > 0) ? it / e : 0
+            sps = (sw == "") ? "" : sprintf("%.1f", (e > 0) ? sw / e : 0)
+            printf "%s,%d,%.3f,%d,%.1f,%s,%s,%.3f,%d,%s,%s,%.3f\n",
+                   m, r, e, it, ips, sw, sps, d, yr, ym, v, g
+        }' >> "$CSV"
+    tail -n1 "$CSV"
+}
+
+echo "Benchmark: cpu=$CPU duration=${DURATION}s reps=$REPS modes=\"$MODES\" loader_args=\"$LOADER_ARGS\""
+for mode in $MODES; do
+    for rep in $(seq "$REPS"); do
+        echo "== $mode rep $rep"
+        run_one "$mode" "$rep"
+    done
+done
+
+# Per-mode means, relative to the cfs baseline when present
+awk -F, 'NR > 1 {
+        if (!($1 in n)) order[++nm] = $1
+        n[$1]++; ips[$1] += $5; dcpu[$1] += $8; gidle[$1] += $12
+        if ($7 != "") { nsw[$1]++; sps[$1] += $7 }
+        if ($11 == "fail") fail[$1]++
+    }
+    END {
+        base = ("cfs" in n) ? ips["cfs"] / n["cfs"] : 0
+        printf "{\n  \"modes\": [\n"
+        for (i = 1; i <= nm; i++) {
+            m = order[i]
+            mi = ips[m] / n[m]
+            printf "    {\"mode\": \"%s\", \"runs\": %d, \"iter_per_s\": %.1f, " \
+                   "\"switches_per_s\": %s, \"dumper_cpu_s\": %.3f, " \
+                   "\"gate_idle_s\": %.3f, " \
+                   "\"verify_failures\": %d, \"relative_to_cfs\": %s}%s\n",
+                   m, n[m], mi, (nsw[m] ? sprintf("%.1f", sps[m] / nsw[m]) : "null"),
+                   dcpu[m] / n[m], gidle[m] / n[m], fail[m] + 0,
+                   (base > 0 ? sprintf("%.3f", mi / base) : "null"),
+                   (i < nm ? "," : "")
+        }
+        printf "  ]\n}\n"
+    }' "$CSV" > "$JSON"
+
+echo ""
+echo "Results: $CSV"
+echo "Summary: $JSON"
+cat "$JSON"
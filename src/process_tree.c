@@ -10,11 +10,16 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <time.h>
+#include <sched.h>
+#include "scx_ring.h"
 
 #define Y_FILE "Y.txt"
 #define MAX_RECORDS 100000
 
 static int enable_display = 0;  /* Disabled by default */
+static int run_duration = 0;    /* Seconds to run before stopping, 0 = until Ctrl+C */
+static const char *publish_name; /* Also stream records to this shared-memory ring */
 
 #define NUM_LAYERS 3
 #define NUM_CHILDREN 2
@@ -46,6 +51,9 @@ typedef struct {
     int running;
     pthread_mutex_t mutex;         /* Single lock for all operations */
     unsigned long record_idx;      /* Next record index */
+    unsigned long iterations;      /* Total worker iterations (not capped) */
+    int publish;                   /* Stream records to y_ring (--publish) */
+    struct scx_ring_writer y_ring; /* Shared by all processes, written under mutex */
     record_t records[MAX_RECORDS]; /* Buffer of records */
 } shared_data_t;
 
@@ -164,6 +172,20 @@ void worker_loop(int process_id, int thread_id) {
             shared->record_idx++;
         }
 
+        /* Live copy for scx_verify; not capped by MAX_RECORDS */
+        if (shared->publish) {
+            struct scx_event ev = {
+                .seq = shared->iterations + 1, .tgid = my_pid, .tid = my_tid,
+                .cls = SCX_EV_EXT, .cpu = sched_getcpu(),
+            };
+            struct timespec ts;
+
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ev.ts_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+            scx_ring_write(&shared->y_ring, &ev);
+        }
+        shared->iterations++;
+
         pthread_mutex_unlock(&shared->mutex);
 
         /* Sleep to allow natural context switch - not spinning */
@@ -221,24 +243,39 @@ void create_process_tree(int current_layer, int process_id) {
 }
 
 static void usage(const char *prog) {
-    fprintf(stderr, "Usage: %s [--display]\n", prog);
+    fprintf(stderr, "Usage: %s [--display] [--duration <sec>] [--publish <name>]\n", prog);
     fprintf(stderr, "Options:\n");
-    fprintf(stderr, "  --display    Enable visual tree display\n");
+    fprintf(stderr, "  --display         Enable visual tree display\n");
+    fprintf(stderr, "  --duration <sec>  Stop after <sec> seconds (default: run until Ctrl+C)\n");
+    fprintf(stderr, "  --publish <name>  Also stream records to /dev/shm/<name> as they happen\n");
+    fprintf(stderr, "                    (for scx_verify; usual name: %s)\n", SCX_RING_Y_NAME);
 }
 
 int main(int argc, char **argv) {
     static struct option long_options[] = {
-        {"display", no_argument, NULL, 'd'},
-        {"help",    no_argument, NULL, 'h'},
+        {"display",  no_argument,       NULL, 'd'},
+        {"duration", required_argument, NULL, 't'},
+        {"publish",  required_argument, NULL, 'P'},
+        {"help",     no_argument,       NULL, 'h'},
         {0, 0, 0, 0}
     };
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "dh", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "dt:P:h", long_options, NULL)) != -1) {
         switch (opt) {
         case 'd':
             enable_display = 1;
             break;
+        case 't':
+            run_duration = atoi(optarg);
+            if (run_duration <= 0) {
+                fprintf(stderr, "Invalid duration: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'P':
+            publish_name = optarg;
+            break;
         case 'h':
         default:
             usage(argv[0]);
@@ -248,6 +285,7 @@ int main(int argc, char **argv) {
 
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
+    signal(SIGALRM, handle_signal);
 
     shared = mmap(NULL, sizeof(shared_data_t), PROT_READ | PROT_WRITE,
                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
@@ -264,6 +302,17 @@ int main(int argc, char **argv) {
     shared->active_thread = 0;
     shared->running = 1;
     shared->record_idx = 0;
+    shared->iterations = 0;
+
+    /* Created before fork so every process writes through the same shared state */
+    if (publish_name) {
+        if (scx_ring_writer_create(&shared->y_ring, publish_name, SCX_RING_DEFAULT_SLOTS)) {
+            fprintf(stderr, "Failed to create ring %s: %s\n", publish_name, strerror(errno));
+            exit(1);
+        }
+        shared->publish = 1;
+        printf("Publishing records to /dev/shm%s\n", shared->y_ring.name);
+    }
 
     pthread_t display_thread;
     if (enable_display) {
@@ -273,8 +322,16 @@ int main(int argc, char **argv) {
     printf("Process tree running (display=%s). Press Ctrl+C to stop.\n",
            enable_display ? "on" : "off");
 
+    struct timespec start_ts, end_ts;
+    clock_gettime(CLOCK_MONOTONIC, &start_ts);
+
+    /* Only the root process arms the timer; children see shared->running */
+    if (run_duration > 0)
+        alarm(run_duration);
+
     create_process_tree(0, 0);
 
+    clock_gettime(CLOCK_MONOTONIC, &end_ts);
     shared->running = 0;
     if (enable_display) {
         pthread_join(display_thread, NULL);
@@ -282,6 +339,12 @@ int main(int argc, char **argv) {
     }
     printf("Process tree terminated.\n");
 
+    double elapsed = (end_ts.tv_sec - start_ts.tv_sec) +
+                     (end_ts.tv_nsec - start_ts.tv_nsec) / 1e9;
+    printf("Elapsed: %.3f s\n", elapsed);
+    printf("Worker iterations: %lu (%.1f/s)\n", shared->iterations,
+           elapsed > 0 ? shared->iterations / elapsed : 0.0);
+
     /* Dump records to Y.txt */
     unsigned long num_records = shared->record_idx;
     if (num_records > MAX_RECORDS)
@@ -302,6 +365,7 @@ int main(int argc, char **argv) {
     }
 
     /* Cleanup */
+    scx_ring_writer_destroy(&shared->y_ring);
     pthread_mutex_destroy(&shared->mutex);
     munmap(shared, sizeof(shared_data_t));
 
@@ -4,6 +4,13 @@
  * The actual scheduling logic is in scx_scheduler.bpf.c
  *
  * Dumper thread: on every context switch, writes (seq, tgid, tid) to X.txt
+ * and, with -s, republishes it into a shared-memory ring (see scx_ring.h)
+ *
+ * Usersched thread (-U): receives runnable tasks from BPF, decides their
+ * CPU and order in batches and sends the decisions back to dispatch()
+ *
+ * Companion thread (-k): republishes switch-outs of non-ext tasks on the
+ * traced CPU, reported by a sched_switch tracepoint, into the same ring
  */
 #define _GNU_SOURCE
 #include <stdio.h>
@@ -12,20 +19,56 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <stdbool.h>
 #include <libgen.h>
 #include <pthread.h>
 #include <sched.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/stat.h>
 #include <linux/limits.h>
 #include <bpf/libbpf.h>
 #include <bpf/bpf.h>
+#include <bpf/btf.h>
+#include "scx_ring.h"
 
 #define BPF_OBJ_NAME "scx_scheduler.bpf.o"
 #define OUTPUT_FILE "X.txt"
+#define TIER_MAP_PIN "/sys/fs/bpf/scx_tier_map"  /* Must match scx_run.c */
+#define SAMPLE_RATE_MAP_PIN "/sys/fs/bpf/scx_sample_rate_map"  /* Must match scx_run.c */
+#define CLASS_GEN_MAP_PIN "/sys/fs/bpf/scx_class_gen_map"  /* Must match scx_run.c */
+#define CGRP_MAP_PIN "/sys/fs/bpf/scx_cgrp_map"
+#define TRACE_STATS_MAP_PIN "/sys/fs/bpf/scx_trace_stats_map"
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define DEFAULT_SAMPLE_RATE 10
+#define DEFAULT_USERSCHED_TIMEOUT_MS 100
+#define DEFAULT_SLICE_US 20000  /* Must match SCX_SLICE_DFL in scx_scheduler.bpf.c */
+#define DEFAULT_STARVE_MS 250
+#define NR_DSQS 4               /* Must match scx_scheduler.bpf.c */
+#define CGRP_DSQ_BASE 0x10000   /* Must match scx_scheduler.bpf.c */
+#define WATCHDOG_LOG_SIZE 64    /* Must match scx_scheduler.bpf.c */
+#define WATCHDOG_LOG_SHOW 16    /* Interventions listed in the final report */
+#define HWEIGHT_ONE (1ULL << 20)  /* Must match scx_scheduler.bpf.c */
+#define MAX_CGRP_REPORT 4096    /* Must match cgrp_ctx_map max_entries */
+#define CGRP_REPORT_SHOW 20     /* Busiest cgroups listed in the final report */
+
+static const char *dsq_names[NR_DSQS] = { "shared", "dumper", "critical", "batch" };
+#define USERSCHED_BATCH_MAX 256
+
+/* Latency tiers, must match enum latency_tier in scx_scheduler.bpf.c */
+#define NR_TIERS 3
+static const char *tier_names[NR_TIERS] = { "critical", "normal", "batch" };
+
+/* Budget defaults, per CPU: critical and normal may not take a CPU's whole period */
+#define DEFAULT_PERIOD_MS   100
+#define DEFAULT_BUDGET_MS   { 50, 90, 0 }
 
 #ifndef SCHED_EXT
 #define SCHED_EXT 7
 #endif
 
+#define SCX_OPS_HAS_CGROUP_WEIGHT (1ULL << 16)
+
 /* Must match struct in scx_scheduler.bpf.c */
 struct dumper_state {
     __u32 last_tgid;
@@ -36,11 +79,228 @@ struct dumper_state {
     __u64 violations;
     __u64 dumper_runs;
     __u64 dispatch_pending_empty;
+    __u32 last_cpu;
+    __u64 pending_since;
+    __u64 gate_opened;
+    __u64 lifted_seq;
+};
+
+/* Must match struct in scx_scheduler.bpf.c */
+struct tier_state {
+    __u64 period_ns;
+    __u64 budget_ns[NR_TIERS];
+    __u64 total_ns[NR_TIERS];
+    __u64 throttled[NR_TIERS];
+};
+
+/* Initial tier memberships from -T, applied after load */
+#define MAX_TIER_ASSIGN 64
+struct tier_assign {
+    __u32 id;
+    __u32 tier;
+};
+
+/* Sampling modes, must match enum sample_mode in scx_scheduler.bpf.c */
+enum sample_mode {
+    SAMPLE_ALL,
+    SAMPLE_GLOBAL,
+    SAMPLE_TID_HASH,
+};
+
+/* Must match struct in scx_scheduler.bpf.c */
+struct trace_stats {
+    __u64 nr_stops;
+    __u64 sampled_in;
+    __u64 sampled_out;
+    __u64 companion;
+    __u64 companion_dropped;
+};
+
+/* Must match struct in scx_scheduler.bpf.c */
+struct cgrp_ctx {
+    __u64 parent;
+    __u64 dsq;
+    __u32 weight;
+    __u32 child_weight_sum;
+    __u32 level;
+    __u32 hweight_gen;
+    __u32 nr_runnable;
+    __u32 nr_active;
+    __u64 hweight;
+    __u64 qweight;
+    __u64 cvtime;
+    __u64 tvtime_now;
+    __u64 usage_ns;
+    __u64 nr_dispatched;
+};
+
+/* Must match struct in scx_scheduler.bpf.c */
+struct cgrp_global {
+    __u32 gen;
+    __u32 next_dsq;
+    __u64 cvtime_now;
+    __u32 nr_untracked;
+};
+
+/* Must match struct in scx_scheduler.bpf.c */
+struct cpu_util {
+    __u64 busy_ns;
+    __u64 idle_ns;
+    __u64 gate_idle_ns;
+    __u64 nr_idle;
+    __u64 nr_gate_idle;
+    __u64 nr_wake_idle;
+    __u64 nr_wake_busy;
+    __u64 last_ns;
+    __u32 idle;
+    __u32 gate_idle;
+    __u32 gate_blocked;
+};
+
+/* One row of the per-cgroup usage report */
+struct cgrp_usage {
+    __u64 cgid;
+    struct cgrp_ctx ctx;
+    char path[PATH_MAX];
+};
+
+/* Watchdog interventions, must match enum watchdog_action in scx_scheduler.bpf.c */
+enum watchdog_action {
+    WD_GATE_LIFT,
+    WD_AGE,
+};
+
+/* Must match struct in scx_scheduler.bpf.c */
+struct watchdog_event {
+    __u64 ts_ns;
+    __u64 wait_ns;
+    __u32 action;
+    __u32 dsq;
+    __u32 pid;
+    __u32 cpu;
+};
+
+/* Must match struct in scx_scheduler.bpf.c */
+struct watchdog_state {
+    __u64 checks;
+    __u64 gate_lifts;
+    __u64 aged[NR_DSQS];
+    __u64 oldest_wait_ns[NR_DSQS];
+    __u64 max_wait_ns[NR_DSQS];
+    __u64 nr_events;
+};
+
+/* Must match struct in scx_scheduler.bpf.c */
+struct companion_event {
+    __u64 ts_ns;
+    __u64 run_ns;
+    __u32 tgid;
+    __u32 tid;
+    __u32 cls;
+    __u32 cpu;
+};
+
+/* Must match struct in scx_scheduler.bpf.c */
+struct usersched_task {
+    __u32 pid;
+    __u32 tgid;
+    __s32 prev_cpu;
+    __u32 tier;
+    __u64 seq;
+    __u64 enq_at;
+};
+
+/* Must match struct in scx_scheduler.bpf.c */
+struct usersched_decision {
+    __u32 pid;
+    __s32 cpu;
+    __u64 seq;
+};
+
+/* Must match struct in scx_scheduler.bpf.c */
+struct usersched_stats {
+    __u64 inflight;
+    __u64 forwarded;
+    __u64 dispatched;
+    __u64 stale;
+    __u64 fallback_full;
+    __u64 fallback_stalled;
+    __u64 rescued;
+    __u64 rtt_sum_ns;
+    __u64 rtt_max_ns;
+    __u64 nr_drains;
+    __u64 drain_sum;
+    __u64 drain_max;
+};
+
+/* Must match struct in scx_scheduler.bpf.c */
+struct usersched_kick_args {
+    __s32 cpu;
+};
+
+/* One batch of runnable tasks collected from the ring buffer */
+struct usersched_batch {
+    struct usersched_task tasks[USERSCHED_BATCH_MAX];
+    int nr;
+};
+
+/* Per-thread sampling rate overrides from -r */
+#define MAX_RATE_OVERRIDES 64
+struct rate_override {
+    __u32 tid;
+    __u32 rate;
+};
+
+/* Tracing modes selectable with -m */
+enum trace_mode {
+    TRACE_OFF,       /* Scheduler only, no dumper registered */
+    TRACE_LOCKSTEP,  /* Dumper records every switch before others run */
+    TRACE_SAMPLE,    /* Dumper records a sampled subset of switches */
+};
+
+static const char *trace_mode_names[] = {
+    [TRACE_OFF]      = "off",
+    [TRACE_LOCKSTEP] = "lockstep",
+    [TRACE_SAMPLE]   = "sample",
 };
 
 static volatile int running = 1;
 static int dumper_state_map_fd = -1;
+static int dumper_ack_map_fd = -1;
+static int class_gen_map_fd = -1;
 static int target_cpu = -1;  /* CPU to pin dumper thread, -1 = no pinning */
+static enum trace_mode trace_mode = TRACE_LOCKSTEP;
+static double dumper_cpu_sec;  /* CPU time consumed by the dumper thread */
+static __u64 tier_period_ms = DEFAULT_PERIOD_MS;
+static __u64 tier_budget_ms[NR_TIERS] = DEFAULT_BUDGET_MS;
+static struct tier_assign tier_assigns[MAX_TIER_ASSIGN];
+static int nr_tier_assigns;
+static __u32 sample_rate = DEFAULT_SAMPLE_RATE;
+static int sample_by_tid;  /* -H: sample whole threads by tid hash */
+static struct rate_override rate_overrides[MAX_RATE_OVERRIDES];
+static int nr_rate_overrides;
+static const char *ring_name;  /* -s: shared-memory ring to republish events to */
+static struct scx_ring_writer event_ring;
+static int usersched;  /* -U: userspace-delegated scheduling */
+static __u64 usersched_timeout_ms = DEFAULT_USERSCHED_TIMEOUT_MS;
+static int usersched_heartbeat_fd = -1;
+static int usersched_kick_fd = -1;
+static struct ring_buffer *usersched_rb;
+static struct user_ring_buffer *usersched_urb;
+static unsigned long usersched_nr_batches, usersched_batch_sum, usersched_batch_max;
+static __u64 slice_us = DEFAULT_SLICE_US;
+static bool debug_counters = true;  /* -q clears: counters compiled out */
+static bool tiered_dsqs = true;     /* -F clears: one DSQ for all tiers */
+static bool companion;              /* -k: also trace non-ext tasks on the traced CPU */
+static struct ring_buffer *companion_rb;
+static struct bpf_link *companion_link;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static __u64 companion_run_ns[SCX_EV_NR_CLASSES];  /* Per-class time on the traced CPU */
+static __u64 companion_nr[SCX_EV_NR_CLASSES];
+static __u64 starve_ms = DEFAULT_STARVE_MS;  /* -A: watchdog threshold, 0 = off */
+static bool cgroup_weights;  /* -G: weight the normal tier by cgroup cpu.weight */
+static struct cgrp_usage *cgrp_usage;  /* Rows being resolved by cgrp_path_cb() */
+static int nr_cgrp_usage;
 
 static void sigint_handler(int sig)
 {
@@ -78,6 +338,805 @@ static const char *find_bpf_obj(char *argv0, char *buf, size_t buflen)
     return NULL;
 }
 
+/* Parse a tier name, returns -1 if unknown */
+static int parse_tier(const char *name)
+{
+    int i;
+
+    for (i = 0; i < NR_TIERS; i++) {
+        if (strcmp(name, tier_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Parse "<key>=<value>" into key and value strings, modifies arg */
+static int split_kv(char *arg, char **key, char **value)
+{
+    char *eq = strchr(arg, '=');
+
+    if (!eq || eq == arg || !eq[1])
+        return -1;
+    *eq = '\0';
+    *key = arg;
+    *value = eq + 1;
+    return 0;
+}
+
+/*
+ * Tell BPF that task classification inputs changed. Tasks cache their
+ * classification in task storage and redo it when the generation moves.
+ */
+static void bump_class_gen(void)
+{
+    __u32 key = 0;
+    __u32 gen;
+
+    if (class_gen_map_fd < 0 || bpf_map_lookup_elem(class_gen_map_fd, &key, &gen))
+        return;
+    gen++;
+    bpf_map_update_elem(class_gen_map_fd, &key, &gen, BPF_ANY);
+}
+
+/* Write budgets and initial memberships into the tier maps */
+static int setup_tiers(struct bpf_object *obj)
+{
+    struct bpf_map *ts_map, *t_map;
+    struct tier_state ts = {0};
+    __u32 key = 0;
+    int i;
+
+    ts_map = bpf_object__find_map_by_name(obj, "tier_state_map");
+    t_map = bpf_object__find_map_by_name(obj, "tier_map");
+    if (!ts_map || !t_map) {
+        fprintf(stderr, "Failed to find tier maps\n");
+        return -1;
+    }
+
+    ts.period_ns = tier_period_ms * 1000000ULL;
+    for (i = 0; i < NR_TIERS; i++)
+        ts.budget_ns[i] = tier_budget_ms[i] * 1000000ULL;
+    if (bpf_map_update_elem(bpf_map__fd(ts_map), &key, &ts, BPF_ANY)) {
+        fprintf(stderr, "Failed to set tier budgets: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < nr_tier_assigns; i++) {
+        if (bpf_map_update_elem(bpf_map__fd(t_map), &tier_assigns[i].id,
+                                &tier_assigns[i].tier, BPF_ANY)) {
+            fprintf(stderr, "Failed to assign %u to tier %s: %s\n", tier_assigns[i].id,
+                    tier_names[tier_assigns[i].tier], strerror(errno));
+            return -1;
+        }
+    }
+
+    /* Pin membership map so scx_run --class can update it at runtime */
+    unlink(TIER_MAP_PIN);
+    if (bpf_map__pin(t_map, TIER_MAP_PIN)) {
+        fprintf(stderr, "WARNING: Failed to pin tier map at %s: %s\n",
+                TIER_MAP_PIN, strerror(errno));
+    }
+
+    return 0;
+}
+
+/* Write per-thread sampling overrides into the rate map */
+static int setup_sampling(struct bpf_object *obj)
+{
+    struct bpf_map *rate_map, *stats_map;
+    int i;
+
+    rate_map = bpf_object__find_map_by_name(obj, "sample_rate_map");
+    stats_map = bpf_object__find_map_by_name(obj, "trace_stats_map");
+    if (!rate_map || !stats_map) {
+        fprintf(stderr, "Failed to find sampling maps\n");
+        return -1;
+    }
+
+    for (i = 0; i < nr_rate_overrides; i++) {
+        if (bpf_map_update_elem(bpf_map__fd(rate_map), &rate_overrides[i].tid,
+                                &rate_overrides[i].rate, BPF_ANY)) {
+            fprintf(stderr, "Failed to set sample rate of %u: %s\n",
+                    rate_overrides[i].tid, strerror(errno));
+            return -1;
+        }
+    }
+
+    /* Pin override map so scx_run --rate can change rates while tracing */
+    unlink(SAMPLE_RATE_MAP_PIN);
+    unlink(CLASS_GEN_MAP_PIN);
+    if (bpf_map__pin(rate_map, SAMPLE_RATE_MAP_PIN)) {
+        fprintf(stderr, "WARNING: Failed to pin sample rate map at %s: %s\n",
+                SAMPLE_RATE_MAP_PIN, strerror(errno));
+    }
+
+    /* Pin the per-CPU counters so sampled-in/out can be read while tracing */
+    unlink(TRACE_STATS_MAP_PIN);
+    if (bpf_map__pin(stats_map, TRACE_STATS_MAP_PIN)) {
+        fprintf(stderr, "WARNING: Failed to pin trace stats map at %s: %s\n",
+                TRACE_STATS_MAP_PIN, strerror(errno));
+    }
+
+    return 0;
+}
+
+/* Sum the per-CPU switch and sampling counters */
+static int read_trace_stats(struct bpf_object *obj, struct trace_stats *total)
+{
+    struct bpf_map *map = bpf_object__find_map_by_name(obj, "trace_stats_map");
+    int nr_cpus = libbpf_num_possible_cpus();
+    struct trace_stats *percpu;
+    __u32 key = 0;
+    int i;
+
+    memset(total, 0, sizeof(*total));
+    if (!map || nr_cpus <= 0)
+        return -1;
+
+    percpu = calloc(nr_cpus, sizeof(*percpu));
+    if (!percpu)
+        return -1;
+
+    if (bpf_map_lookup_elem(bpf_map__fd(map), &key, percpu)) {
+        free(percpu);
+        return -1;
+    }
+
+    for (i = 0; i < nr_cpus; i++) {
+        total->nr_stops += percpu[i].nr_stops;
+        total->sampled_in += percpu[i].sampled_in;
+        total->sampled_out += percpu[i].sampled_out;
+        total->companion += percpu[i].companion;
+        total->companion_dropped += percpu[i].companion_dropped;
+    }
+
+    free(percpu);
+    return 0;
+}
+
+/*
+ * Read the per-CPU time accounting, with the period still running on each
+ * CPU folded in (bpf_ktime_get_ns() is CLOCK_MONOTONIC). Caller frees.
+ */
+static struct cpu_util *read_cpu_util(struct bpf_object *obj, int *nr)
+{
+    struct bpf_map *map = bpf_object__find_map_by_name(obj, "cpu_util_map");
+    int nr_cpus = libbpf_num_possible_cpus();
+    struct cpu_util *percpu;
+    struct timespec ts;
+    __u64 now;
+    __u32 key = 0;
+    int i;
+
+    if (!map || nr_cpus <= 0)
+        return NULL;
+
+    percpu = calloc(nr_cpus, sizeof(*percpu));
+    if (!percpu)
+        return NULL;
+
+    if (bpf_map_lookup_elem(bpf_map__fd(map), &key, percpu)) {
+        free(percpu);
+        return NULL;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    for (i = 0; i < nr_cpus; i++) {
+        struct cpu_util *cu = &percpu[i];
+
+        if (!cu->last_ns || now < cu->last_ns)
+            continue;
+        if (cu->idle)
+            cu->idle_ns += now - cu->last_ns;
+        else
+            cu->busy_ns += now - cu->last_ns;
+    }
+
+    *nr = nr_cpus;
+    return percpu;
+}
+
+/* Tell BPF we are alive; stale heartbeats make it stop forwarding tasks */
+static void usersched_beat(void)
+{
+    struct timespec ts;
+    __u32 key = 0;
+    __u64 now;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    bpf_map_update_elem(usersched_heartbeat_fd, &key, &now, BPF_ANY);
+}
+
+/* Wake cpu if idle so it runs dispatch() and drains our decisions */
+static void usersched_kick_cpu(int cpu)
+{
+    struct usersched_kick_args args = { .cpu = cpu };
+    LIBBPF_OPTS(bpf_test_run_opts, opts,
+        .ctx_in = &args,
+        .ctx_size_in = sizeof(args),
+    );
+
+    bpf_prog_test_run_opts(usersched_kick_fd, &opts);
+}
+
+/* Ring buffer callback: collect one runnable task into the batch */
+static int usersched_collect(void *ctx, void *data, size_t size)
+{
+    struct usersched_batch *batch = ctx;
+
+    if (size < sizeof(struct usersched_task))
+        return 0;
+
+    memcpy(&batch->tasks[batch->nr++], data, sizeof(struct usersched_task));
+
+    /* Batch full: stop consuming, the rest stays queued for the next poll */
+    return batch->nr == USERSCHED_BATCH_MAX ? -E2BIG : 0;
+}
+
+/* Higher tier first, then FIFO by enqueue time */
+static int usersched_task_cmp(const void *a, const void *b)
+{
+    const struct usersched_task *ta = a, *tb = b;
+
+    if (ta->tier != tb->tier)
+        return ta->tier < tb->tier ? -1 : 1;
+    if (ta->enq_at != tb->enq_at)
+        return ta->enq_at < tb->enq_at ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Placement policy: order the batch and pick a CPU per task. This is the
+ * hook for policies too complex for BPF; the default keeps each task on
+ * its previous CPU and orders by tier, then enqueue time.
+ */
+static void usersched_decide(struct usersched_batch *batch, struct usersched_decision *out)
+{
+    int i;
+
+    qsort(batch->tasks, batch->nr, sizeof(batch->tasks[0]), usersched_task_cmp);
+
+    for (i = 0; i < batch->nr; i++) {
+        out[i].pid = batch->tasks[i].pid;
+        out[i].cpu = batch->tasks[i].prev_cpu;
+        out[i].seq = batch->tasks[i].seq;
+    }
+}
+
+/* Send decisions to BPF in order, then wake the CPUs that got work */
+static void usersched_submit(struct usersched_decision *dec, int nr)
+{
+    struct usersched_decision *slot;
+    int i, j;
+
+    for (i = 0; i < nr; i++) {
+        /* Ring full means BPF has not drained yet; wait, never drop */
+        while (!(slot = user_ring_buffer__reserve(usersched_urb, sizeof(*slot)))) {
+            if (!running)
+                return;
+            usersched_kick_cpu(dec[i].cpu >= 0 ? dec[i].cpu : 0);
+            usersched_beat();
+            usleep(100);
+        }
+        *slot = dec[i];
+        user_ring_buffer__submit(usersched_urb, slot);
+    }
+
+    /* Kick each distinct target CPU once */
+    for (i = 0; i < nr; i++) {
+        if (dec[i].cpu < 0)
+            continue;
+        for (j = 0; j < i; j++) {
+            if (dec[j].cpu == dec[i].cpu)
+                break;
+        }
+        if (j == i)
+            usersched_kick_cpu(dec[i].cpu);
+    }
+}
+
+/* Usersched thread: receive runnable tasks, decide in batches, reply */
+static void *usersched_thread(void *arg)
+{
+    static struct usersched_batch batch;
+    static struct usersched_decision decisions[USERSCHED_BATCH_MAX];
+    int err;
+
+    (void)arg;
+    printf("Usersched thread started (TID=%d)\n", gettid());
+
+    while (running) {
+        usersched_beat();
+
+        batch.nr = 0;
+        err = ring_buffer__poll(usersched_rb, 10);
+        if (err < 0 && err != -E2BIG && err != -EINTR) {
+            fprintf(stderr, "Usersched ring buffer poll failed: %s\n", strerror(-err));
+            break;
+        }
+        if (!batch.nr)
+            continue;
+
+        usersched_decide(&batch, decisions);
+        usersched_submit(decisions, batch.nr);
+
+        usersched_nr_batches++;
+        usersched_batch_sum += batch.nr;
+        if ((unsigned long)batch.nr > usersched_batch_max)
+            usersched_batch_max = batch.nr;
+    }
+
+    printf("Usersched thread exiting\n");
+    return NULL;
+}
+
+/* Open the BPF <-> userspace rings for delegated scheduling */
+static int setup_usersched(struct bpf_object *obj)
+{
+    struct bpf_map *hb_map, *queue, *decisions;
+    struct bpf_program *kick;
+
+    if (!usersched)
+        return 0;
+
+    hb_map = bpf_object__find_map_by_name(obj, "usersched_heartbeat");
+    queue = bpf_object__find_map_by_name(obj, "usersched_queue");
+    decisions = bpf_object__find_map_by_name(obj, "usersched_decisions");
+    kick = bpf_object__find_program_by_name(obj, "usersched_kick");
+    if (!hb_map || !queue || !decisions || !kick) {
+        fprintf(stderr, "Failed to find usersched maps\n");
+        return -1;
+    }
+
+    usersched_heartbeat_fd = bpf_map__fd(hb_map);
+    usersched_kick_fd = bpf_program__fd(kick);
+    usersched_beat();
+
+    usersched_rb = ring_buffer__new(bpf_map__fd(queue), usersched_collect, NULL, NULL);
+    usersched_urb = user_ring_buffer__new(bpf_map__fd(decisions), NULL);
+    if (!usersched_rb || !usersched_urb) {
+        fprintf(stderr, "Failed to open usersched ring buffers: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Publish to the shared-memory ring; the dumper and companion threads share it */
+static void publish_event(const struct scx_event *ev)
+{
+    if (companion)
+        pthread_mutex_lock(&ring_lock);
+    scx_ring_write(&event_ring, ev);
+    if (companion)
+        pthread_mutex_unlock(&ring_lock);
+}
+
+/* Ring buffer callback: one non-ext task gave up the traced CPU */
+static int companion_collect(void *ctx, void *data, size_t size)
+{
+    const struct companion_event *ce = data;
+    struct scx_event ev = {0};
+
+    if (size < sizeof(*ce) || ce->cls >= SCX_EV_NR_CLASSES)
+        return 0;
+
+    companion_run_ns[ce->cls] += ce->run_ns;
+    companion_nr[ce->cls]++;
+
+    ev.ts_ns = ce->ts_ns;
+    ev.tgid = ce->tgid;
+    ev.tid = ce->tid;
+    ev.cls = ce->cls;
+    ev.cpu = ce->cpu;
+    ev.run_ns = ce->run_ns;
+    publish_event(&ev);
+    return 0;
+}
+
+/* Companion thread: drain tracepoint events into the shared ring */
+static void *companion_thread(void *arg)
+{
+    int err;
+
+    (void)arg;
+    printf("Companion thread started (TID=%d)\n", gettid());
+
+    while (running) {
+        err = ring_buffer__poll(companion_rb, 100);
+        if (err < 0 && err != -EINTR) {
+            fprintf(stderr, "Companion ring buffer poll failed: %s\n", strerror(-err));
+            break;
+        }
+    }
+
+    /* Pick up what was reported before we were told to stop */
+    ring_buffer__consume(companion_rb);
+    printf("Companion thread exiting\n");
+    return NULL;
+}
+
+/* Attach the sched_switch tracepoint and open its ring buffer */
+static int setup_companion(struct bpf_object *obj)
+{
+    struct bpf_program *prog;
+    struct bpf_map *events;
+
+    if (!companion)
+        return 0;
+
+    prog = bpf_object__find_program_by_name(obj, "companion_switch");
+    events = bpf_object__find_map_by_name(obj, "companion_events");
+    if (!prog || !events) {
+        fprintf(stderr, "Failed to find companion program\n");
+        return -1;
+    }
+
+    companion_rb = ring_buffer__new(bpf_map__fd(events), companion_collect, NULL, NULL);
+    if (!companion_rb) {
+        fprintf(stderr, "Failed to open companion ring buffer: %s\n", strerror(errno));
+        return -1;
+    }
+
+    companion_link = bpf_program__attach(prog);
+    if (!companion_link) {
+        fprintf(stderr, "Failed to attach sched_switch tracepoint: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Set a const volatile global in the object's .rodata. Only valid between
+ * open and load; the verifier then treats the value as a constant.
+ */
+static int set_rodata(struct bpf_object *obj, const char *name, const void *val, size_t size)
+{
+    struct btf *btf = bpf_object__btf(obj);
+    struct bpf_map *rodata = bpf_object__find_map_by_name(obj, ".rodata");
+    const struct btf_type *sec, *var;
+    struct btf_var_secinfo *vsi;
+    size_t map_size;
+    char *data;
+    __s32 id;
+    int i;
+
+    if (!btf || !rodata)
+        return -1;
+
+    data = bpf_map__initial_value(rodata, &map_size);
+    id = btf__find_by_name_kind(btf, ".rodata", BTF_KIND_DATASEC);
+    if (!data || id < 0)
+        return -1;
+
+    sec = btf__type_by_id(btf, id);
+    vsi = btf_var_secinfos(sec);
+    for (i = 0; i < btf_vlen(sec); i++, vsi++) {
+        var = btf__type_by_id(btf, vsi->type);
+        if (strcmp(btf__name_by_offset(btf, var->name_off), name) != 0)
+            continue;
+        if (vsi->size != size || vsi->offset + size > map_size)
+            return -1;
+        memcpy(data + vsi->offset, val, size);
+        return 0;
+    }
+
+    return -1;
+}
+
+/*
+ * Without -G, leave the cgroup callbacks out of scheduler_ops and stop
+ * claiming cpu.weight support, so the kernel neither calls into BPF on
+ * every wakeup and cgroup change nor expects weights to be honoured.
+ * Edits the struct_ops map's initial value (libbpf >= 1.4); a NULL member
+ * is not registered and its program is not loaded.
+ */
+static int drop_cgroup_ops(struct bpf_object *obj)
+{
+    static const char *const cgroup_ops[] = {
+        "runnable", "quiescent", "cgroup_init", "cgroup_exit", "cgroup_move",
+        "cgroup_set_weight",
+    };
+    struct btf *btf = bpf_object__btf(obj);
+    struct bpf_map *ops = bpf_object__find_map_by_name(obj, "scheduler_ops");
+    const struct btf_member *m;
+    const struct btf_type *t;
+    struct bpf_program *prog;
+    const char *name;
+    size_t size, j;
+    char *data;
+    __u32 off;
+    __s32 id;
+    int i;
+
+    if (!btf || !ops)
+        return -1;
+
+    data = bpf_map__initial_value(ops, &size);
+    id = btf__find_by_name_kind(btf, "sched_ext_ops", BTF_KIND_STRUCT);
+    if (!data || id < 0)
+        return -1;
+
+    t = btf__type_by_id(btf, id);
+    m = btf_members(t);
+    for (i = 0; i < btf_vlen(t); i++, m++) {
+        name = btf__name_by_offset(btf, m->name_off);
+        off = btf_member_bit_offset(t, i) / 8;
+        if (!name || off + sizeof(__u64) > size)
+            continue;
+
+        if (strcmp(name, "flags") == 0) {
+            *(__u64 *)(data + off) &= ~SCX_OPS_HAS_CGROUP_WEIGHT;
+            continue;
+        }
+        for (j = 0; j < sizeof(cgroup_ops) / sizeof(cgroup_ops[0]); j++) {
+            if (strcmp(name, cgroup_ops[j]) != 0)
+                continue;
+            prog = bpf_object__find_program_by_name(obj, name);
+            if (prog)
+                bpf_program__set_autoload(prog, false);
+            *(void **)(data + off) = NULL;
+        }
+    }
+
+    return 0;
+}
+
+/* Specialize the scheduler for the selected modes before it is verified */
+static int setup_rodata(struct bpf_object *obj)
+{
+    bool trace_enabled = trace_mode != TRACE_OFF;
+    __u32 sample_mode = SAMPLE_ALL;
+    __u32 rate = 1;
+    bool usersched_enabled = usersched;
+    __u64 timeout_ns = usersched_timeout_ms * 1000000ULL;
+    __u64 slice_ns = slice_us * 1000ULL;
+    __s32 cpu = target_cpu;
+    bool watchdog_enabled = starve_ms > 0;
+    __u64 starve_ns = starve_ms * 1000000ULL;
+    /* Check a few times per threshold so waits overshoot it by little */
+    __u64 interval_ns = starve_ns / 5 > 1000000 ? starve_ns / 5 : 1000000;
+    struct bpf_program *prog;
+
+    if (trace_mode == TRACE_SAMPLE) {
+        sample_mode = sample_by_tid ? SAMPLE_TID_HASH : SAMPLE_GLOBAL;
+        rate = sample_rate;
+    }
+
+    if (set_rodata(obj, "trace_enabled", &trace_enabled, sizeof(trace_enabled)) ||
+        set_rodata(obj, "trace_sample_mode", &sample_mode, sizeof(sample_mode)) ||
+        set_rodata(obj, "trace_sample_rate", &rate, sizeof(rate)) ||
+        set_rodata(obj, "usersched_enabled", &usersched_enabled, sizeof(usersched_enabled)) ||
+        set_rodata(obj, "usersched_timeout_ns", &timeout_ns, sizeof(timeout_ns)) ||
+        set_rodata(obj, "slice_ns", &slice_ns, sizeof(slice_ns)) ||
+        set_rodata(obj, "debug_counters", &debug_counters, sizeof(debug_counters)) ||
+        set_rodata(obj, "tiered_dsqs", &tiered_dsqs, sizeof(tiered_dsqs)) ||
+        set_rodata(obj, "companion_enabled", &companion, sizeof(companion)) ||
+        set_rodata(obj, "companion_cpu", &cpu, sizeof(cpu)) ||
+        set_rodata(obj, "watchdog_enabled", &watchdog_enabled, sizeof(watchdog_enabled)) ||
+        set_rodata(obj, "cgroup_weights", &cgroup_weights, sizeof(cgroup_weights)) ||
+        (watchdog_enabled &&
+         (set_rodata(obj, "starve_thresh_ns", &starve_ns, sizeof(starve_ns)) ||
+          set_rodata(obj, "watchdog_interval_ns", &interval_ns, sizeof(interval_ns))))) {
+        fprintf(stderr, "Failed to set load-time config in .rodata\n");
+        return -1;
+    }
+
+    /* Without -k the tracepoint is not even loaded */
+    prog = bpf_object__find_program_by_name(obj, "companion_switch");
+    if (prog)
+        bpf_program__set_autoload(prog, companion);
+
+    /* Older libbpf: the ops stay registered but return at once */
+    if (!cgroup_weights && drop_cgroup_ops(obj))
+        fprintf(stderr, "WARNING: cgroup ops left in scheduler_ops (needs libbpf >= 1.4)\n");
+
+    return 0;
+}
+
+/* Print watchdog interventions: totals, worst waits and the latest log entries */
+static void print_watchdog(struct bpf_object *obj)
+{
+    struct bpf_map *ws_map = bpf_object__find_map_by_name(obj, "watchdog_state_map");
+    struct bpf_map *log_map = bpf_object__find_map_by_name(obj, "watchdog_log");
+    struct watchdog_state ws;
+    struct watchdog_event ev;
+    __u64 first, n;
+    __u32 key = 0;
+    int d;
+
+    if (!ws_map || !log_map || bpf_map_lookup_elem(bpf_map__fd(ws_map), &key, &ws))
+        return;
+
+    printf("\n");
+    printf("  WATCHDOG (threshold %llums, %llu checks)\n", (unsigned long long)starve_ms,
+           (unsigned long long)ws.checks);
+    printf("  Gate lifts:                %llu\n", (unsigned long long)ws.gate_lifts);
+    printf("  DSQ        Aged  Max wait(ms)\n");
+    for (d = 0; d < NR_DSQS; d++) {
+        if (d == 1)  /* DUMPER_DSQ is not aged */
+            continue;
+        printf("  %-9s  %4llu  %12.1f\n", dsq_names[d], (unsigned long long)ws.aged[d],
+               ws.max_wait_ns[d] / 1e6);
+    }
+
+    if (!ws.nr_events)
+        return;
+
+    first = ws.nr_events > WATCHDOG_LOG_SHOW ? ws.nr_events - WATCHDOG_LOG_SHOW : 0;
+    printf("  Last interventions:\n");
+    for (n = first; n < ws.nr_events; n++) {
+        key = n % WATCHDOG_LOG_SIZE;
+        if (bpf_map_lookup_elem(bpf_map__fd(log_map), &key, &ev))
+            continue;
+        printf("    %s %-9s pid %-7u cpu %-3u waited %.1f ms\n",
+               ev.action == WD_GATE_LIFT ? "gate-lift" : "age      ",
+               ev.dsq < NR_DSQS ? dsq_names[ev.dsq] : ev.dsq >= CGRP_DSQ_BASE ? "cgroup" : "?",
+               ev.pid, ev.cpu, ev.wait_ns / 1e6);
+    }
+}
+
+/* Print busy, idle and gate-induced idle time of every CPU seen by update_idle() */
+static void print_cpu_util(struct bpf_object *obj)
+{
+    struct cpu_util *percpu, total = {0};
+    int nr_cpus, i;
+
+    percpu = read_cpu_util(obj, &nr_cpus);
+    if (!percpu)
+        return;
+
+    printf("\n");
+    printf("  CPU    Busy(%%)  Idle(%%)  Gate idle(%%)  Gate idle(ms)  Wakeups idle/busy\n");
+    for (i = 0; i < nr_cpus; i++) {
+        struct cpu_util *cu = &percpu[i];
+        double span = cu->busy_ns + cu->idle_ns;
+
+        if (!cu->last_ns)
+            continue;
+        printf("  %3d%c  %8.1f  %7.1f  %12.1f  %13.1f  %8llu/%llu\n", i,
+               i == target_cpu ? '*' : ' ',
+               span ? 100.0 * cu->busy_ns / span : 0.0,
+               span ? 100.0 * cu->idle_ns / span : 0.0,
+               span ? 100.0 * cu->gate_idle_ns / span : 0.0,
+               cu->gate_idle_ns / 1e6, (unsigned long long)cu->nr_wake_idle,
+               (unsigned long long)cu->nr_wake_busy);
+        total.busy_ns += cu->busy_ns;
+        total.idle_ns += cu->idle_ns;
+        total.gate_idle_ns += cu->gate_idle_ns;
+        total.nr_wake_idle += cu->nr_wake_idle;
+        total.nr_wake_busy += cu->nr_wake_busy;
+    }
+
+    if (total.busy_ns + total.idle_ns) {
+        double span = total.busy_ns + total.idle_ns;
+
+        printf("  all   %8.1f  %7.1f  %12.1f  %13.1f  %8llu/%llu\n",
+               100.0 * total.busy_ns / span, 100.0 * total.idle_ns / span,
+               100.0 * total.gate_idle_ns / span, total.gate_idle_ns / 1e6,
+               (unsigned long long)total.nr_wake_idle, (unsigned long long)total.nr_wake_busy);
+    }
+    if (target_cpu >= 0)
+        printf("  (* traced CPU)\n");
+
+    free(percpu);
+}
+
+/* nftw() callback: a cgroup's id is the inode number of its directory */
+static int cgrp_path_cb(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    int i;
+
+    if (type != FTW_D)
+        return 0;
+
+    for (i = 0; i < nr_cgrp_usage; i++) {
+        if (cgrp_usage[i].cgid == st->st_ino) {
+            snprintf(cgrp_usage[i].path, sizeof(cgrp_usage[i].path), "%s",
+                     path[strlen(CGROUP_ROOT)] ? path + strlen(CGROUP_ROOT) : "/");
+            break;
+        }
+    }
+    return 0;
+}
+
+static int cgrp_usage_cmp(const void *a, const void *b)
+{
+    const struct cgrp_usage *ua = a, *ub = b;
+
+    if (ua->ctx.usage_ns != ub->ctx.usage_ns)
+        return ua->ctx.usage_ns > ub->ctx.usage_ns ? -1 : 1;
+    return 0;
+}
+
+/* Print the busiest cgroups with their weight, machine share and usage */
+static void print_cgroups(struct bpf_object *obj)
+{
+    struct bpf_map *map = bpf_object__find_map_by_name(obj, "cgrp_ctx_map");
+    struct bpf_map *global_map;
+    struct cgrp_global cg;
+    __u64 key, next, total = 0;
+    __u32 zero = 0;
+    int fd, i, err;
+
+    if (!map)
+        return;
+    fd = bpf_map__fd(map);
+
+    cgrp_usage = calloc(MAX_CGRP_REPORT, sizeof(*cgrp_usage));
+    if (!cgrp_usage)
+        return;
+
+    for (err = bpf_map_get_next_key(fd, NULL, &next);
+         !err && nr_cgrp_usage < MAX_CGRP_REPORT;
+         err = bpf_map_get_next_key(fd, &key, &next)) {
+        struct cgrp_usage *u = &cgrp_usage[nr_cgrp_usage];
+
+        key = next;
+        if (bpf_map_lookup_elem(fd, &key, &u->ctx) || !u->ctx.usage_ns)
+            continue;
+        u->cgid = key;
+        snprintf(u->path, sizeof(u->path), "cgroup id %llu", (unsigned long long)key);
+        total += u->ctx.usage_ns;
+        nr_cgrp_usage++;
+    }
+
+    if (nr_cgrp_usage) {
+        nftw(CGROUP_ROOT, cgrp_path_cb, 16, FTW_PHYS | FTW_MOUNT);
+        qsort(cgrp_usage, nr_cgrp_usage, sizeof(*cgrp_usage), cgrp_usage_cmp);
+
+        printf("\n");
+        printf("  Cgroup                                    Weight  Share(%%)  Runtime(ms)  Used(%%)\n");
+        for (i = 0; i < nr_cgrp_usage && i < CGRP_REPORT_SHOW; i++) {
+            struct cgrp_usage *u = &cgrp_usage[i];
+
+            printf("  %-40.40s  %6u  %8.1f  %11.1f  %7.1f\n", u->path, u->ctx.weight,
+                   100.0 * u->ctx.qweight / HWEIGHT_ONE, u->ctx.usage_ns / 1e6,
+                   100.0 * u->ctx.usage_ns / total);
+        }
+        if (nr_cgrp_usage > CGRP_REPORT_SHOW)
+            printf("  ... %d more (live: bpftool map dump pinned %s)\n",
+                   nr_cgrp_usage - CGRP_REPORT_SHOW, CGRP_MAP_PIN);
+    }
+
+    global_map = bpf_object__find_map_by_name(obj, "cgrp_global_map");
+    if (global_map && !bpf_map_lookup_elem(bpf_map__fd(global_map), &zero, &cg) &&
+        cg.nr_untracked)
+        printf("  %u cgroups untracked (cgroup map full), their tasks shared the normal tier DSQ\n",
+               cg.nr_untracked);
+
+    free(cgrp_usage);
+    cgrp_usage = NULL;
+    nr_cgrp_usage = 0;
+}
+
+/*
+ * Keep the loader's own threads off the traced CPU. On it, every switch of
+ * the companion thread would itself be reported and wake it again, and any
+ * loader thread there steals time from the traced tasks. Threads created
+ * afterwards inherit the mask; the dumper pins itself back to target_cpu.
+ */
+static void keep_off_target_cpu(void)
+{
+    cpu_set_t cpuset;
+
+    if (target_cpu < 0 || sched_getaffinity(0, sizeof(cpuset), &cpuset))
+        return;
+
+    CPU_CLR(target_cpu, &cpuset);
+    if (CPU_COUNT(&cpuset) == 0) {
+        fprintf(stderr, "WARNING: Only CPU %d allowed, loader threads share it with the trace\n",
+                target_cpu);
+        return;
+    }
+    if (sched_setaffinity(0, sizeof(cpuset), &cpuset))
+        fprintf(stderr, "WARNING: Failed to move loader threads off CPU %d: %s\n",
+                target_cpu, strerror(errno));
+}
+
 /* Dumper thread function */
 static void *dumper_thread(void *arg)
 {
@@ -115,6 +1174,7 @@ static void *dumper_thread(void *arg)
     if (bpf_map_lookup_elem(dumper_state_map_fd, &key, &state) == 0) {
         state.dumper_tid = my_tid;
         bpf_map_update_elem(dumper_state_map_fd, &key, &state, BPF_ANY);
+        bump_class_gen();
         printf("Dumper TID registered in BPF map\n");
     } else {
         fprintf(stderr, "Failed to read BPF map: %s\n", strerror(errno));
@@ -146,12 +1206,28 @@ static void *dumper_thread(void *arg)
             fprintf(output, "%lu %u %u\n", (unsigned long)state.seq, tgid, tid);
             fflush(output);
 
+            /* Fan out to shared-memory readers, never blocks */
+            if (ring_name) {
+                struct scx_event ev = {
+                    .seq = state.seq, .tgid = tgid, .tid = tid,
+                    .cls = SCX_EV_EXT, .cpu = state.last_cpu,
+                };
+                struct timespec ts;
+
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                ev.ts_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+                publish_event(&ev);
+            }
+
             /* Update our last processed seq */
             last_seq = state.seq;
 
-            /* Clear pending flag so other tasks can run */
-            state.pending = 0;
-            bpf_map_update_elem(dumper_state_map_fd, &key, &state, BPF_ANY);
+            /*
+             * Acknowledge it; BPF opens the gate once the ack matches seq.
+             * Never write dumper_state back: switches after a watchdog gate
+             * lift may have advanced it since we read it.
+             */
+            bpf_map_update_elem(dumper_ack_map_fd, &key, &last_seq, BPF_ANY);
         }
 
         /* Yield CPU if no work */
@@ -161,16 +1237,55 @@ static void *dumper_thread(void *arg)
     if (output)
         fclose(output);
 
+    /* Record our own CPU cost for the final report */
+    {
+        struct timespec ts;
+        if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+            dumper_cpu_sec = ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
     printf("Dumper thread exiting\n");
     return NULL;
 }
 
 static void usage(const char *prog)
 {
-    fprintf(stderr, "Usage: %s -c <cpu>\n", prog);
+    fprintf(stderr, "Usage: %s -c <cpu> [-m <mode>] [-n <rate>] [-H] [-r <tid>=<rate>]\n", prog);
+    fprintf(stderr, "       [-p <ms>] [-b <tier>=<ms>] [-T <id>=<tier>] [-s <name>] [-U [-W <ms>]]\n");
+    fprintf(stderr, "       [-S <us>] [-F] [-q] [-k] [-A <ms>] [-g]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Options:\n");
-    fprintf(stderr, "  -c <cpu>   CPU to pin dumper thread (required)\n");
+    fprintf(stderr, "  -c <cpu>        CPU to pin dumper thread (required)\n");
+    fprintf(stderr, "  -m <mode>       Tracing mode: off, lockstep, sample (default: lockstep)\n");
+    fprintf(stderr, "  -n <rate>       sample: trace 1 in <rate> switches (default: %d)\n", DEFAULT_SAMPLE_RATE);
+    fprintf(stderr, "  -H              sample: pick 1 in <rate> threads by tid hash and\n");
+    fprintf(stderr, "                  trace all their switches\n");
+    fprintf(stderr, "  -r <tid>=<rate> sample: per-thread rate, 0 = never, 1 = always (repeatable)\n");
+    fprintf(stderr, "  -p <ms>         Tier budget period (default: %d)\n", DEFAULT_PERIOD_MS);
+    fprintf(stderr, "  -b <tier>=<ms>  Runtime budget per CPU per period for a tier, 0 = unlimited\n");
+    fprintf(stderr, "                  (defaults: critical=50 normal=90 batch=0)\n");
+    fprintf(stderr, "  -T <id>=<tier>  Put a tid or tgid in a tier (repeatable)\n");
+    fprintf(stderr, "  -s <name>       Republish events to shared-memory ring /dev/shm/<name>\n");
+    fprintf(stderr, "                  (read with scx_tail -s <name>)\n");
+    fprintf(stderr, "  -U              Userspace-delegated scheduling: the loader decides CPU\n");
+    fprintf(stderr, "                  and order of runnable tasks in batches\n");
+    fprintf(stderr, "  -W <ms>         -U: treat userspace as stalled after <ms> without a\n");
+    fprintf(stderr, "                  poll and fall back to the tier DSQs (default: %d)\n",
+            DEFAULT_USERSCHED_TIMEOUT_MS);
+    fprintf(stderr, "  -S <us>         Time slice (default: %d)\n", DEFAULT_SLICE_US);
+    fprintf(stderr, "  -F              Flat DSQ layout: all tiers share one FIFO, no budgets\n");
+    fprintf(stderr, "  -q              Leave out the violation/debug counters\n");
+    fprintf(stderr, "  -k              With -s: also publish switch-outs of non-ext tasks\n");
+    fprintf(stderr, "                  (CFS, kthreads, RT, DL, idle) on the -c CPU\n");
+    fprintf(stderr, "  -A <ms>         Starvation watchdog: lift a gate closed, or run a task\n");
+    fprintf(stderr, "                  queued, for longer than <ms>; 0 = off (default: %d)\n",
+            DEFAULT_STARVE_MS);
+    fprintf(stderr, "  -G              Share the normal tier by cgroup cpu.weight; every\n");
+    fprintf(stderr, "                  normal-tier dispatch scans all cgroups, so off by default\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Modes, -S, -F and -q are fixed at load time; disabled paths cost nothing.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Tiers: critical, normal, batch\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Example:\n");
     fprintf(stderr, "  sudo %s -c 1\n", prog);
@@ -180,16 +1295,20 @@ static void usage(const char *prog)
 int main(int argc, char **argv)
 {
     struct bpf_object *obj;
-    struct bpf_map *map, *state_map;
+    struct bpf_map *map, *state_map, *ack_map, *gen_map;
     struct bpf_link *link = NULL;
     char bpf_path[PATH_MAX];
     const char *bpf_obj;
-    pthread_t dumper_tid;
+    pthread_t dumper_tid, usersched_tid, companion_tid;
+    bool dumper_started = false, usersched_started = false, companion_started = false;
     int err;
     int opt;
+    size_t i;
+    char *key, *value;
+    int tier;
 
     /* Parse command line arguments */
-    while ((opt = getopt(argc, argv, "c:h")) != -1) {
+    while ((opt = getopt(argc, argv, "c:m:n:Hr:p:b:T:s:UW:S:FqkA:Gh")) != -1) {
         switch (opt) {
         case 'c':
             target_cpu = atoi(optarg);
@@ -198,6 +1317,103 @@ int main(int argc, char **argv)
                 return 1;
             }
             break;
+        case 'm':
+            for (i = 0; i < sizeof(trace_mode_names) / sizeof(trace_mode_names[0]); i++) {
+                if (strcmp(optarg, trace_mode_names[i]) == 0)
+                    break;
+            }
+            if (i == sizeof(trace_mode_names) / sizeof(trace_mode_names[0])) {
+                fprintf(stderr, "Invalid mode: %s\n", optarg);
+                return 1;
+            }
+            trace_mode = i;
+            break;
+        case 'n':
+            sample_rate = strtoul(optarg, NULL, 0);
+            if (sample_rate == 0) {
+                fprintf(stderr, "Invalid sample rate: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'H':
+            sample_by_tid = 1;
+            break;
+        case 'r':
+            if (split_kv(optarg, &key, &value) || atoi(key) <= 0) {
+                fprintf(stderr, "Invalid rate override: %s (expected <tid>=<rate>)\n", optarg);
+                return 1;
+            }
+            if (nr_rate_overrides == MAX_RATE_OVERRIDES) {
+                fprintf(stderr, "Too many -r overrides (max %d)\n", MAX_RATE_OVERRIDES);
+                return 1;
+            }
+            rate_overrides[nr_rate_overrides].tid = atoi(key);
+            rate_overrides[nr_rate_overrides].rate = strtoul(value, NULL, 0);
+            nr_rate_overrides++;
+            break;
+        case 'p':
+            tier_period_ms = strtoull(optarg, NULL, 0);
+            if (tier_period_ms == 0) {
+                fprintf(stderr, "Invalid period: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            if (split_kv(optarg, &key, &value) || (tier = parse_tier(key)) < 0) {
+                fprintf(stderr, "Invalid budget: %s (expected <tier>=<ms>)\n", optarg);
+                return 1;
+            }
+            tier_budget_ms[tier] = strtoull(value, NULL, 0);
+            break;
+        case 'T':
+            if (split_kv(optarg, &key, &value) || (tier = parse_tier(value)) < 0 ||
+                atoi(key) <= 0) {
+                fprintf(stderr, "Invalid tier assignment: %s (expected <id>=<tier>)\n", optarg);
+                return 1;
+            }
+            if (nr_tier_assigns == MAX_TIER_ASSIGN) {
+                fprintf(stderr, "Too many -T assignments (max %d)\n", MAX_TIER_ASSIGN);
+                return 1;
+            }
+            tier_assigns[nr_tier_assigns].id = atoi(key);
+            tier_assigns[nr_tier_assigns].tier = tier;
+            nr_tier_assigns++;
+            break;
+        case 's':
+            ring_name = optarg;
+            break;
+        case 'U':
+            usersched = 1;
+            break;
+        case 'W':
+            usersched_timeout_ms = strtoull(optarg, NULL, 0);
+            if (usersched_timeout_ms == 0) {
+                fprintf(stderr, "Invalid timeout: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'S':
+            slice_us = strtoull(optarg, NULL, 0);
+            if (slice_us == 0) {
+                fprintf(stderr, "Invalid slice: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'F':
+            tiered_dsqs = false;
+            break;
+        case 'q':
+            debug_counters = false;
+            break;
+        case 'k':
+            companion = true;
+            break;
+        case 'A':
+            starve_ms = strtoull(optarg, NULL, 0);
+            break;
+        case 'G':
+            cgroup_weights = true;
+            break;
         case 'h':
         default:
             usage(argv[0]);
@@ -211,6 +1427,11 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if (companion && (!ring_name || trace_mode == TRACE_OFF)) {
+        fprintf(stderr, "Error: -k publishes into the -s ring and needs tracing on\n");
+        return 1;
+    }
+
     libbpf_set_print(libbpf_print_fn);
 
     /* Find BPF object file */
@@ -227,6 +1448,12 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    /* Load-time config must be written between open and load */
+    if (setup_rodata(obj)) {
+        err = -1;
+        goto cleanup;
+    }
+
     /* Load BPF object */
     err = bpf_object__load(obj);
     if (err) {
@@ -234,14 +1461,59 @@ int main(int argc, char **argv)
         goto cleanup;
     }
 
-    /* Find the dumper_state_map */
+    /* Find the dumper_state_map and the map the dumper acknowledges in */
     state_map = bpf_object__find_map_by_name(obj, "dumper_state_map");
-    if (!state_map) {
-        fprintf(stderr, "Failed to find dumper_state_map\n");
+    ack_map = bpf_object__find_map_by_name(obj, "dumper_ack_map");
+    if (!state_map || !ack_map) {
+        fprintf(stderr, "Failed to find dumper_state_map/dumper_ack_map\n");
         err = -1;
         goto cleanup;
     }
     dumper_state_map_fd = bpf_map__fd(state_map);
+    dumper_ack_map_fd = bpf_map__fd(ack_map);
+
+    /* Classification generation, pinned for scx_run --class --pid */
+    gen_map = bpf_object__find_map_by_name(obj, "class_gen_map");
+    if (!gen_map) {
+        fprintf(stderr, "Failed to find class_gen_map\n");
+        err = -1;
+        goto cleanup;
+    }
+    class_gen_map_fd = bpf_map__fd(gen_map);
+    unlink(CLASS_GEN_MAP_PIN);
+    if (bpf_map__pin(gen_map, CLASS_GEN_MAP_PIN)) {
+        fprintf(stderr, "WARNING: Failed to pin class gen map at %s: %s\n",
+                CLASS_GEN_MAP_PIN, strerror(errno));
+    }
+
+    /* Per-cgroup weights and usage, pinned for live inspection */
+    if (cgroup_weights) {
+        struct bpf_map *cgrp_map = bpf_object__find_map_by_name(obj, "cgrp_ctx_map");
+
+        unlink(CGRP_MAP_PIN);
+        if (!cgrp_map || bpf_map__pin(cgrp_map, CGRP_MAP_PIN)) {
+            fprintf(stderr, "WARNING: Failed to pin cgroup map at %s: %s\n",
+                    CGRP_MAP_PIN, strerror(errno));
+        }
+    }
+
+    /* Budgets and memberships must be in place before tasks are scheduled */
+    if (setup_tiers(obj) || setup_sampling(obj) || setup_usersched(obj)) {
+        err = -1;
+        goto cleanup;
+    }
+
+    keep_off_target_cpu();
+
+    /* Start deciding before attach so forwarded tasks never wait on us */
+    if (usersched) {
+        if (pthread_create(&usersched_tid, NULL, usersched_thread, NULL) != 0) {
+            fprintf(stderr, "Failed to create usersched thread: %s\n", strerror(errno));
+            err = -1;
+            goto cleanup;
+        }
+        usersched_started = true;
+    }
 
     /* Find and attach the struct_ops map */
     map = bpf_object__find_map_by_name(obj, "scheduler_ops");
@@ -275,15 +1547,53 @@ int main(int argc, char **argv)
 
     printf("==========================================\n");
     printf("  sched_ext scheduler loaded!\n");
-    printf("  Dumper will run on CPU %d\n", target_cpu);
+    printf("  Tracing mode: %s\n", trace_mode_names[trace_mode]);
+    if (trace_mode == TRACE_SAMPLE)
+        printf("  Sampling 1 in %u %s\n", sample_rate, sample_by_tid ? "threads" : "switches");
+    if (trace_mode != TRACE_OFF)
+        printf("  Dumper will run on CPU %d\n", target_cpu);
+    printf("  Slice %lluus, %s DSQs%s\n", (unsigned long long)slice_us,
+           tiered_dsqs ? "tiered" : "flat", debug_counters ? "" : ", no debug counters");
+    if (usersched)
+        printf("  Scheduling delegated to userspace (timeout %llums)\n",
+               (unsigned long long)usersched_timeout_ms);
     printf("==========================================\n");
 
-    /* Start dumper thread */
-    if (pthread_create(&dumper_tid, NULL, dumper_thread, NULL) != 0) {
-        fprintf(stderr, "Failed to create dumper thread: %s\n", strerror(errno));
+    /* Create the fan-out ring before the dumper starts writing to it */
+    if (ring_name && trace_mode != TRACE_OFF) {
+        if (scx_ring_writer_create(&event_ring, ring_name, SCX_RING_DEFAULT_SLOTS)) {
+            fprintf(stderr, "Failed to create ring %s: %s\n", ring_name, strerror(errno));
+            err = -1;
+            goto cleanup;
+        }
+        printf("Publishing events to /dev/shm%s\n", event_ring.name);
+    } else {
+        ring_name = NULL;
+    }
+
+    /* Companion events go into the ring, so it must exist first */
+    if (setup_companion(obj)) {
         err = -1;
         goto cleanup;
     }
+    if (companion) {
+        if (pthread_create(&companion_tid, NULL, companion_thread, NULL) != 0) {
+            fprintf(stderr, "Failed to create companion thread: %s\n", strerror(errno));
+            err = -1;
+            goto cleanup;
+        }
+        companion_started = true;
+    }
+
+    /* Start dumper thread */
+    if (trace_mode != TRACE_OFF) {
+        if (pthread_create(&dumper_tid, NULL, dumper_thread, NULL) != 0) {
+            fprintf(stderr, "Failed to create dumper thread: %s\n", strerror(errno));
+            err = -1;
+            goto cleanup;
+        }
+        dumper_started = true;
+    }
 
     printf("Press Ctrl+C to unload...\n\n");
 
@@ -296,24 +1606,74 @@ int main(int argc, char **argv)
 
     printf("\nUnloading scheduler...\n");
 
-    /* Wait for dumper thread */
-    pthread_join(dumper_tid, NULL);
+    /* Wait for the worker threads before reading their final counts */
+    if (dumper_started)
+        pthread_join(dumper_tid, NULL);
+    if (usersched_started)
+        pthread_join(usersched_tid, NULL);
+    if (companion_started)
+        pthread_join(companion_tid, NULL);
+    dumper_started = usersched_started = companion_started = false;
 
     /* Print verification results */
     {
         __u32 key = 0;
         struct dumper_state final_state;
+        struct trace_stats ts;
+
+        if (read_trace_stats(obj, &ts))
+            memset(&ts, 0, sizeof(ts));
         if (bpf_map_lookup_elem(dumper_state_map_fd, &key, &final_state) == 0) {
             printf("\n");
             printf("========================================\n");
             printf("       VERIFICATION RESULTS\n");
             printf("========================================\n");
+            printf("  Tracing mode:              %s\n", trace_mode_names[trace_mode]);
+            printf("  Switch-outs (all tasks):   %lu\n", (unsigned long)ts.nr_stops);
             printf("  Context switches (seq):    %lu\n", (unsigned long)final_state.seq);
-            printf("  Dumper runs (pending=1):   %lu\n", (unsigned long)final_state.dumper_runs);
-            printf("  DUMPER_DSQ empty:          %lu\n", (unsigned long)final_state.dispatch_pending_empty);
-            printf("  Violations:                %lu\n", (unsigned long)final_state.violations);
+            if (debug_counters) {
+                printf("  Dumper runs (pending=1):   %lu\n", (unsigned long)final_state.dumper_runs);
+                printf("  DUMPER_DSQ empty:          %lu\n", (unsigned long)final_state.dispatch_pending_empty);
+                printf("  Violations:                %lu\n", (unsigned long)final_state.violations);
+            }
+            if (trace_mode == TRACE_SAMPLE) {
+                printf("  Sampled in:                %llu\n", (unsigned long long)ts.sampled_in);
+                printf("  Sampled out (skipped):     %llu\n", (unsigned long long)ts.sampled_out);
+                printf("  Scale factor:              %.2f\n", ts.sampled_in ?
+                       (double)(ts.sampled_in + ts.sampled_out) / ts.sampled_in : 0.0);
+            }
+            if (companion) {
+                printf("  Non-ext switch-outs:       %llu (%llu dropped)\n",
+                       (unsigned long long)ts.companion,
+                       (unsigned long long)ts.companion_dropped);
+            }
+            printf("  Dumper CPU time:           %.3f s\n", dumper_cpu_sec);
+            if (trace_mode != TRACE_OFF) {
+                struct cpu_util *percpu;
+                __u64 gate_idle_ns = 0;
+                int nr_cpus, i;
+
+                percpu = read_cpu_util(obj, &nr_cpus);
+                if (percpu) {
+                    for (i = 0; i < nr_cpus; i++)
+                        gate_idle_ns += percpu[i].gate_idle_ns;
+                    printf("  Gate idle (all CPUs):      %.3f s\n", gate_idle_ns / 1e9);
+                    free(percpu);
+                }
+            }
+            if (starve_ms) {
+                struct bpf_map *ws_map = bpf_object__find_map_by_name(obj, "watchdog_state_map");
+                struct watchdog_state ws;
+
+                if (ws_map && bpf_map_lookup_elem(bpf_map__fd(ws_map), &key, &ws) == 0)
+                    printf("  Gate lifts (watchdog):     %llu%s\n",
+                           (unsigned long long)ws.gate_lifts,
+                           ws.gate_lifts ? "  (X/Y order not guaranteed there)" : "");
+            }
             printf("----------------------------------------\n");
-            if (final_state.violations == 0) {
+            if (!debug_counters) {
+                printf("  SKIPPED: debug counters disabled (-q)\n");
+            } else if (final_state.violations == 0) {
                 printf("  PASSED: No violations detected\n");
             } else {
                 printf("  FAILED: %lu violations\n", (unsigned long)final_state.violations);
@@ -322,7 +1682,95 @@ int main(int argc, char **argv)
         }
     }
 
+    /* Print delegated scheduling metrics */
+    if (usersched) {
+        __u32 key = 0;
+        struct usersched_stats us;
+        struct bpf_map *us_map = bpf_object__find_map_by_name(obj, "usersched_stats_map");
+
+        if (us_map && bpf_map_lookup_elem(bpf_map__fd(us_map), &key, &us) == 0) {
+            printf("\n");
+            printf("  USERSCHED\n");
+            printf("  Forwarded:                 %llu\n", (unsigned long long)us.forwarded);
+            printf("  Dispatched by decision:    %llu\n", (unsigned long long)us.dispatched);
+            printf("  Stale decisions:           %llu\n", (unsigned long long)us.stale);
+            printf("  Fallback (ring full):      %llu\n", (unsigned long long)us.fallback_full);
+            printf("  Fallback (stalled):        %llu\n", (unsigned long long)us.fallback_stalled);
+            printf("  Rescued in-flight:         %llu\n", (unsigned long long)us.rescued);
+            printf("  Round trip avg/max (us):   %.1f / %.1f\n",
+                   us.dispatched ? us.rtt_sum_ns / 1e3 / us.dispatched : 0.0,
+                   us.rtt_max_ns / 1e3);
+            printf("  Loader batch avg/max:      %.1f / %lu\n",
+                   usersched_nr_batches ? (double)usersched_batch_sum / usersched_nr_batches : 0.0,
+                   usersched_batch_max);
+            printf("  Dispatch drain avg/max:    %.1f / %llu\n",
+                   us.nr_drains ? (double)us.drain_sum / us.nr_drains : 0.0,
+                   (unsigned long long)us.drain_max);
+        }
+    }
+
+    if (starve_ms)
+        print_watchdog(obj);
+
+    if (cgroup_weights)
+        print_cgroups(obj);
+
+    print_cpu_util(obj);
+
+    /* Print time taken from the traced CPU by other scheduling classes */
+    if (companion) {
+        int c;
+
+        printf("\n");
+        printf("  Class      Switch-outs  Runtime(ms)   (CPU %d, non-ext)\n", target_cpu);
+        for (c = SCX_EV_EXT + 1; c < SCX_EV_NR_CLASSES; c++) {
+            printf("  %-9s  %11llu  %11.1f\n", scx_event_class_names[c],
+                   (unsigned long long)companion_nr[c], companion_run_ns[c] / 1e6);
+        }
+    }
+
+    /* Print per-tier runtime (not tracked with the flat layout) */
+    if (tiered_dsqs) {
+        __u32 key = 0;
+        struct tier_state ts;
+        struct bpf_map *ts_map = bpf_object__find_map_by_name(obj, "tier_state_map");
+        int t;
+
+        if (ts_map && bpf_map_lookup_elem(bpf_map__fd(ts_map), &key, &ts) == 0) {
+            printf("\n");
+            printf("  Tier       Runtime(ms)  Budget/CPU(ms)  Throttled\n");
+            for (t = 0; t < NR_TIERS; t++) {
+                printf("  %-9s  %11.1f  %14llu  %9llu\n", tier_names[t],
+                       ts.total_ns[t] / 1e6, (unsigned long long)(ts.budget_ns[t] / 1000000),
+                       (unsigned long long)ts.throttled[t]);
+            }
+        }
+    }
+
 cleanup:
+    /* On an error path threads may still be polling the rings freed below */
+    running = 0;
+    if (dumper_started)
+        pthread_join(dumper_tid, NULL);
+    if (usersched_started)
+        pthread_join(usersched_tid, NULL);
+    if (companion_started)
+        pthread_join(companion_tid, NULL);
+
+    if (companion_link)
+        bpf_link__destroy(companion_link);
+    if (companion_rb)
+        ring_buffer__free(companion_rb);
+    scx_ring_writer_destroy(&event_ring);
+    if (usersched_rb)
+        ring_buffer__free(usersched_rb);
+    if (usersched_urb)
+        user_ring_buffer__free(usersched_urb);
+    unlink(TIER_MAP_PIN);
+    unlink(SAMPLE_RATE_MAP_PIN);
+    unlink(CLASS_GEN_MAP_PIN);
+    unlink(CGRP_MAP_PIN);
+    unlink(TRACE_STATS_MAP_PIN);
     if (link)
         bpf_link__destroy(link);
     bpf_object__close(obj);
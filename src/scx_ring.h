@@ -0,0 +1,282 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * scx_ring.h - single-producer, multi-consumer event ring in /dev/shm
+ *
+ * scx_loader republishes every traced context switch into a named POSIX
+ * shared-memory ring so any number of local readers can follow the stream
+ * without attaching BPF programs or re-reading X.txt.
+ *
+ * The producer never waits for readers. Each reader keeps its own cursor
+ * in its own memory; a reader that falls more than a ring's worth behind
+ * skips ahead and counts the events it lost, without affecting anyone else.
+ *
+ * Each slot carries a stamp (position + 1) written after the event, so a
+ * reader can tell a complete slot from one being overwritten (seqlock).
+ *
+ * Besides the traced SCHED_EXT switches (class SCX_EV_EXT, same as X.txt),
+ * scx_loader -k also publishes switch-outs of non-ext tasks on the traced
+ * CPU, tagged with their class, so readers see the whole CPU timeline.
+ */
+#ifndef SCX_RING_H
+#define SCX_RING_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SCX_RING_MAGIC      0x53435852u  /* "SCXR" */
+#define SCX_RING_VERSION    2
+#define SCX_RING_DEFAULT_NAME "scx_events"  /* /dev/shm/scx_events */
+#define SCX_RING_Y_NAME     "scx_y"       /* process_tree --publish default */
+#define SCX_RING_DEFAULT_SLOTS (1u << 16)
+
+/* Scheduling class of the switched-out task, must match scx_scheduler.bpf.c */
+enum scx_event_class {
+    SCX_EV_EXT,         /* SCHED_EXT task traced by the dumper (a line of X.txt) */
+    SCX_EV_FAIR,        /* CFS/EEVDF user task */
+    SCX_EV_KTHREAD,     /* Kernel thread (incl. ksoftirqd, kworkers) */
+    SCX_EV_RT,          /* SCHED_FIFO / SCHED_RR */
+    SCX_EV_DL,          /* SCHED_DEADLINE */
+    SCX_EV_IDLE,        /* The CPU's idle task */
+    SCX_EV_NR_CLASSES,
+};
+
+static const char *const scx_event_class_names[SCX_EV_NR_CLASSES] = {
+    [SCX_EV_EXT]     = "ext",
+    [SCX_EV_FAIR]    = "fair",
+    [SCX_EV_KTHREAD] = "kthread",
+    [SCX_EV_RT]      = "rt",
+    [SCX_EV_DL]      = "dl",
+    [SCX_EV_IDLE]    = "idle",
+};
+
+/* One context switch, same fields as a line of X.txt plus timing and class */
+struct scx_event {
+    uint64_t seq;       /* Context switch sequence number, 0 for non-ext events */
+    uint64_t ts_ns;     /* CLOCK_MONOTONIC: publish time (ext), switch-out time (others) */
+    uint32_t tgid;      /* Process ID of the switched-out task */
+    uint32_t tid;       /* Thread ID of the switched-out task */
+    uint32_t cls;       /* enum scx_event_class */
+    uint32_t cpu;       /* CPU the task ran on */
+    uint64_t run_ns;    /* Non-ext events: how long the task held the CPU */
+};
+
+struct scx_ring_slot {
+    _Atomic uint64_t stamp;     /* pos + 1 once the slot holds event pos, 0 while written */
+    struct scx_event ev;
+};
+
+struct scx_ring_hdr {
+    _Atomic uint32_t magic;     /* Written last by the producer: ring is ready */
+    uint32_t version;
+    uint64_t nr_slots;          /* Power of two */
+    /* Producer-written, on its own cache line so readers don't false-share */
+    _Alignas(64) _Atomic uint64_t head;  /* Next position to be written */
+    _Alignas(64) struct scx_ring_slot slots[];
+};
+
+static inline size_t scx_ring_size(uint64_t nr_slots)
+{
+    return sizeof(struct scx_ring_hdr) + nr_slots * sizeof(struct scx_ring_slot);
+}
+
+/* shm_open() names need a leading slash, accept both "x" and "/x" */
+static inline void scx_ring_shm_name(const char *name, char *buf, size_t len)
+{
+    snprintf(buf, len, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+/* ---- Producer ---- */
+
+struct scx_ring_writer {
+    struct scx_ring_hdr *hdr;
+    size_t map_len;
+    uint64_t head;              /* Local copy, we are the only writer */
+    char name[64];
+};
+
+/* Create (or replace) ring <name>; nr_slots must be a power of two */
+static inline int scx_ring_writer_create(struct scx_ring_writer *w, const char *name,
+                                         uint64_t nr_slots)
+{
+    int fd;
+
+    if (!nr_slots || (nr_slots & (nr_slots - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(w, 0, sizeof(*w));
+    scx_ring_shm_name(name, w->name, sizeof(w->name));
+    w->map_len = scx_ring_size(nr_slots);
+
+    shm_unlink(w->name);
+    fd = shm_open(w->name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+        return -1;
+
+    if (ftruncate(fd, w->map_len) < 0) {
+        close(fd);
+        shm_unlink(w->name);
+        return -1;
+    }
+
+    w->hdr = mmap(NULL, w->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (w->hdr == MAP_FAILED) {
+        w->hdr = NULL;
+        shm_unlink(w->name);
+        return -1;
+    }
+
+    w->hdr->version = SCX_RING_VERSION;
+    w->hdr->nr_slots = nr_slots;
+    atomic_store_explicit(&w->hdr->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&w->hdr->magic, SCX_RING_MAGIC, memory_order_release);
+    return 0;
+}
+
+/*
+ * Publish one event. Never blocks; overwrites the oldest slot when full.
+ * Single producer: callers publishing from several threads must serialize.
+ */
+static inline void scx_ring_write(struct scx_ring_writer *w, const struct scx_event *ev)
+{
+    struct scx_ring_slot *slot = &w->hdr->slots[w->head & (w->hdr->nr_slots - 1)];
+
+    atomic_store_explicit(&slot->stamp, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->ev = *ev;
+    atomic_store_explicit(&slot->stamp, w->head + 1, memory_order_release);
+
+    w->head++;
+    atomic_store_explicit(&w->hdr->head, w->head, memory_order_release);
+}
+
+/* Unmap and remove the ring; readers that still have it mapped keep their copy */
+static inline void scx_ring_writer_destroy(struct scx_ring_writer *w)
+{
+    if (!w->hdr)
+        return;
+    munmap(w->hdr, w->map_len);
+    shm_unlink(w->name);
+    w->hdr = NULL;
+}
+
+/* ---- Consumer ---- */
+
+struct scx_ring_reader {
+    const struct scx_ring_hdr *hdr;
+    size_t map_len;
+    uint64_t cursor;            /* Next position this reader will read */
+    uint64_t lost;              /* Events overwritten before we read them */
+};
+
+/*
+ * Attach to ring <name>. With from_oldest the reader starts at the oldest
+ * event still in the ring, otherwise only new events are returned.
+ */
+static inline int scx_ring_reader_open(struct scx_ring_reader *r, const char *name,
+                                       int from_oldest)
+{
+    char shm_name[64];
+    struct stat st;
+    uint64_t head, nr_slots;
+    void *map;
+    int fd;
+
+    memset(r, 0, sizeof(*r));
+
+    scx_ring_shm_name(name, shm_name, sizeof(shm_name));
+    fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct scx_ring_hdr)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    r->hdr = map;
+    r->map_len = st.st_size;
+    nr_slots = r->hdr->nr_slots;
+    if (atomic_load_explicit(&r->hdr->magic, memory_order_acquire) != SCX_RING_MAGIC ||
+        r->hdr->version != SCX_RING_VERSION || scx_ring_size(nr_slots) > r->map_len) {
+        munmap(map, r->map_len);
+        r->hdr = NULL;
+        errno = EPROTO;
+        return -1;
+    }
+
+    head = atomic_load_explicit(&r->hdr->head, memory_order_acquire);
+    if (from_oldest)
+        r->cursor = head > nr_slots ? head - nr_slots : 0;
+    else
+        r->cursor = head;
+    return 0;
+}
+
+/* Events published but not yet read by this reader */
+static inline uint64_t scx_ring_lag(const struct scx_ring_reader *r)
+{
+    return atomic_load_explicit(&r->hdr->head, memory_order_acquire) - r->cursor;
+}
+
+/*
+ * Read the next event into *ev. Returns 1 if an event was read, 0 if the
+ * reader is caught up. Overwritten events are skipped and added to r->lost.
+ */
+static inline int scx_ring_read(struct scx_ring_reader *r, struct scx_event *ev)
+{
+    uint64_t nr_slots = r->hdr->nr_slots;
+    const struct scx_ring_slot *slot;
+    uint64_t head, stamp;
+
+    for (;;) {
+        head = atomic_load_explicit(&r->hdr->head, memory_order_acquire);
+        if (r->cursor >= head)
+            return 0;
+
+        /* Fell a full ring behind: jump to the oldest slot still intact */
+        if (head - r->cursor > nr_slots) {
+            r->lost += head - nr_slots - r->cursor;
+            r->cursor = head - nr_slots;
+        }
+
+        slot = &r->hdr->slots[r->cursor & (nr_slots - 1)];
+        stamp = atomic_load_explicit(&slot->stamp, memory_order_acquire);
+        if (stamp == r->cursor + 1) {
+            *ev = slot->ev;
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&slot->stamp, memory_order_relaxed) == stamp) {
+                r->cursor++;
+                return 1;
+            }
+        }
+
+        /* Slot was overwritten under us, count it and move on */
+        r->lost++;
+        r->cursor++;
+    }
+}
+
+static inline void scx_ring_reader_close(struct scx_ring_reader *r)
+{
+    if (r->hdr)
+        munmap((void *)r->hdr, r->map_len);
+    r->hdr = NULL;
+}
+
+#endif /* SCX_RING_H */
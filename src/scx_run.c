@@ -1,6 +1,7 @@
 /*
  * scx_run - Launch a program with SCHED_EXT scheduling policy
- * Usage: scx_run <program> [args...]
+ * Usage: scx_run [--class <tier>] [--rate <n>] <program> [args...]
+ *        scx_run [--class <tier>] [--rate <n>] --pid <id>
  */
 #define _GNU_SOURCE
 #include <stdio.h>
@@ -9,11 +10,21 @@
 #include <sched.h>
 #include <errno.h>
 #include <string.h>
+#include <getopt.h>
+#include <bpf/bpf.h>
 
 #ifndef SCHED_EXT
 #define SCHED_EXT 7
 #endif
 
+#define TIER_MAP_PIN "/sys/fs/bpf/scx_tier_map"  /* Must match scx_loader.c */
+#define CLASS_GEN_MAP_PIN "/sys/fs/bpf/scx_class_gen_map"  /* Must match scx_loader.c */
+#define SAMPLE_RATE_MAP_PIN "/sys/fs/bpf/scx_sample_rate_map"  /* Must match scx_loader.c */
+
+/* Latency tiers, must match enum latency_tier in scx_scheduler.bpf.c */
+static const char *tier_names[] = { "critical", "normal", "batch" };
+#define NR_TIERS (int)(sizeof(tier_names) / sizeof(tier_names[0]))
+
 /* Check if sched_ext scheduler is enabled */
 static int is_scx_enabled(void) {
     FILE *f = fopen("/sys/kernel/sched_ext/state", "r");
@@ -29,12 +40,118 @@ static int is_scx_enabled(void) {
     return 0;
 }
 
+/* Make running tasks pick up a tier change (they cache their classification) */
+static void bump_class_gen(void) {
+    __u32 key = 0;
+    __u32 gen;
+    int fd = bpf_obj_get(CLASS_GEN_MAP_PIN);
+    if (fd < 0) {
+        fprintf(stderr, "WARNING: Failed to open %s: %s\n", CLASS_GEN_MAP_PIN, strerror(errno));
+        return;
+    }
+
+    if (bpf_map_lookup_elem(fd, &key, &gen) == 0) {
+        gen++;
+        bpf_map_update_elem(fd, &key, &gen, BPF_ANY);
+    }
+    close(fd);
+}
+
+/* Set id's entry in a map pinned by scx_loader, then make tasks reclassify */
+static int set_pinned(const char *pin, const char *what, __u32 id, __u32 val) {
+    int fd = bpf_obj_get(pin);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", pin, strerror(errno));
+        return -1;
+    }
+
+    if (bpf_map_update_elem(fd, &id, &val, BPF_ANY)) {
+        fprintf(stderr, "Failed to set %s of %u: %s\n", what, id, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    bump_class_gen();
+    return 0;
+}
+
+/* Put a tid or tgid in a latency tier */
+static int set_tier(__u32 id, __u32 tier) {
+    return set_pinned(TIER_MAP_PIN, "tier", id, tier);
+}
+
+/* Override the sampling rate of a tid (0 = never, 1 = always, N = 1 in N) */
+static int set_rate(__u32 tid, __u32 rate) {
+    return set_pinned(SAMPLE_RATE_MAP_PIN, "sample rate", tid, rate);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--class <tier>] [--rate <n>] <program> [args...]\n", prog);
+    fprintf(stderr, "       %s [--class <tier>] [--rate <n>] --pid <id>\n", prog);
+    fprintf(stderr, "Launch a program with SCHED_EXT scheduling policy\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --class <tier>  Latency tier: critical, normal, batch\n");
+    fprintf(stderr, "  --rate <n>      Trace 1 in n switches of the thread (0 = never, 1 = all)\n");
+    fprintf(stderr, "  --pid <id>      Change the tier/rate of a running tid/tgid instead\n");
+}
+
 int main(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"class", required_argument, NULL, 'C'},
+        {"rate",  required_argument, NULL, 'r'},
+        {"pid",   required_argument, NULL, 'p'},
+        {"help",  no_argument,       NULL, 'h'},
+        {0, 0, 0, 0}
+    };
     struct sched_param param = { .sched_priority = 0 };
+    int tier = -1;
+    long rate = -1;
+    int target_pid = 0;
+    int opt;
+
+    /* '+' stops at the first non-option so the program's args are left alone */
+    while ((opt = getopt_long(argc, argv, "+C:r:p:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'C':
+            for (tier = 0; tier < NR_TIERS; tier++) {
+                if (strcmp(optarg, tier_names[tier]) == 0)
+                    break;
+            }
+            if (tier == NR_TIERS) {
+                fprintf(stderr, "Invalid class: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            rate = strtol(optarg, NULL, 0);
+            if (rate < 0) {
+                fprintf(stderr, "Invalid rate: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'p':
+            target_pid = atoi(optarg);
+            if (target_pid <= 0) {
+                fprintf(stderr, "Invalid pid: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return (opt == 'h') ? 0 : 1;
+        }
+    }
 
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <program> [args...]\n", argv[0]);
-        fprintf(stderr, "Launch a program with SCHED_EXT scheduling policy\n");
+    if (target_pid && tier < 0 && rate < 0) {
+        fprintf(stderr, "--pid requires --class or --rate\n");
+        return 1;
+    }
+
+    if (!target_pid && optind >= argc) {
+        usage(argv[0]);
         return 1;
     }
 
@@ -45,6 +162,19 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    /* Runtime reclassification of an existing task */
+    if (target_pid) {
+        if (tier >= 0 && set_tier(target_pid, tier))
+            return 1;
+        return (rate >= 0 && set_rate(target_pid, rate)) ? 1 : 0;
+    }
+
+    /* Classify ourselves - exec keeps the pid (the rate covers this thread only) */
+    if (tier >= 0 && set_tier(getpid(), tier))
+        return 1;
+    if (rate >= 0 && set_rate(getpid(), rate))
+        return 1;
+
     /* Set SCHED_EXT for this process - child will inherit */
     if (sched_setscheduler(0, SCHED_EXT, &param) == -1) {
         fprintf(stderr, "Failed to set SCHED_EXT: %s\n", strerror(errno));
@@ -52,9 +182,9 @@ int main(int argc, char **argv) {
     }
 
     /* Exec the target program */
-    execvp(argv[1], &argv[1]);
+    execvp(argv[optind], &argv[optind]);
 
     /* If exec fails */
-    fprintf(stderr, "Failed to exec %s: %s\n", argv[1], strerror(errno));
+    fprintf(stderr, "Failed to exec %s: %s\n", argv[optind], strerror(errno));
     return 1;
 }
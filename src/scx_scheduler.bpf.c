@@ -5,101 +5,1482 @@
  * On every context switch:
  * 1. Save the switched-out task's info
  * 2. Set pending=1 so only dumper can run
- * 3. Dumper reads maps, sets pending=0
- * 4. Other tasks can run
+ * 3. Dumper reads maps, acknowledges the seq it recorded
+ * 4. Once the ack matches seq, the gate is open and other tasks can run
+ *
+ * Non-dumper tasks are split into latency tiers (critical, normal, batch),
+ * each with its own DSQ. dispatch() consumes tiers in priority order, but a
+ * tier that used up its per-period runtime budget on a CPU yields to lower
+ * tiers there.
+ *
+ * In sampling mode only a subset of switches goes through the dumper: one
+ * in N globally, or all switches of the threads whose tid hash selects them.
+ *
+ * In userspace-delegated mode enqueue() forwards runnable tasks to
+ * scx_loader over a ring buffer; the loader places them in batches and
+ * dispatch() drains its decisions from a user ring buffer. If userspace
+ * falls behind, tasks take the normal tier path instead.
+ *
+ * With companion tracing, a sched_switch tracepoint reports switch-outs of
+ * non-SCHED_EXT tasks on the traced CPU, which stopping() never sees, so
+ * userspace can attribute the time they take from traced tasks.
+ *
+ * A timer-driven watchdog bounds how long anything waits: a gate left
+ * closed by a slow or missing dumper is lifted, and tasks that waited too
+ * long in a tier or cgroup DSQ are moved straight to their CPU's local DSQ.
+ *
+ * With -G, normal-tier tasks are further split by cgroup: each cgroup has
+ * a vtime DSQ, and dispatch() serves the cgroup with the lowest vtime,
+ * which advances by runtime divided by the cgroup's hierarchical cpu.weight
+ * share among the cgroups that currently have runnable tasks.
+ *
+ * update_idle() splits each CPU's time into busy, idle, and idle caused by
+ * the gate (dispatch() had nothing it was allowed to run), so the true CPU
+ * cost of each tracing mode can be measured.
+ *
+ * Modes and tunables are const volatile globals that scx_loader sets before
+ * load, so the verifier sees them as constants and drops disabled paths.
  */
 #include "vmlinux.h"
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_tracing.h>
 
-char _license[] SEC("license") = "GPL";
+char _license[] SEC("license") = "GPL";
+
+/* Define SCX constants */
+#define SCX_SLICE_DFL       (20ULL * 1000000)  /* 20ms default slice */
+
+/* Enqueue flags */
+#define SCX_ENQ_WAKEUP      (1LLU << 0)
+#define SCX_ENQ_HEAD        (1LLU << 1)
+
+/* Local DSQ of a specific CPU: SCX_DSQ_LOCAL_ON | cpu */
+#define SCX_DSQ_LOCAL_ON    (3ULL << 62)
+
+/* Kick flags */
+#define SCX_KICK_IDLE       (1LLU << 0)
+
+/* Scheduling policies and task flags (not in vmlinux.h) */
+#define SCHED_FIFO          1
+#define SCHED_RR            2
+#define SCHED_DEADLINE      6
+#define SCHED_EXT           7
+#define PF_KTHREAD          0x00200000
+
+/* Clock for bpf_timer_init() */
+#define CLOCK_MONOTONIC     1
+
+/* errno values (not in vmlinux.h) */
+#define ENOMEM              12
+
+/* DSQ IDs - separate queues for dumper and other tasks */
+#define SHARED_DSQ 0    /* For regular tasks (normal tier) */
+#define DUMPER_DSQ 1    /* For dumper thread only */
+#define CRITICAL_DSQ 2  /* Latency-critical tier */
+#define BATCH_DSQ 3     /* Batch tier */
+#define NR_DSQS 4
+#define CGRP_DSQ_BASE 0x10000  /* Per-cgroup DSQs: CGRP_DSQ_BASE + n */
+
+/* Latency tiers, highest priority first */
+enum latency_tier {
+    TIER_CRITICAL,
+    TIER_NORMAL,
+    TIER_BATCH,
+    NR_TIERS,
+};
+
+/*
+ * Shared state between BPF and userspace dumper
+ */
+struct dumper_state {
+    __u32 last_tgid;    /* Process ID of last switched-out task */
+    __u32 last_tid;     /* Thread ID of last switched-out task */
+    __u32 dumper_tid;   /* TID of dumper thread (set by userspace) */
+    __u64 seq;          /* Context switch sequence number */
+    __u32 pending;      /* 1 once a switch was recorded, gated until acked or lifted */
+    __u64 violations;   /* TEST: count times non-dumper ran while pending=1 */
+    __u64 dumper_runs;  /* TEST: count times dumper ran when pending=1 */
+    __u64 dispatch_pending_empty; /* DEBUG: dispatch called with pending=1 but DUMPER_DSQ empty */
+    __u32 last_cpu;     /* CPU the last switched-out task ran on */
+    __u64 pending_since; /* When pending was last set, for the watchdog */
+    __u64 gate_opened;  /* When the dumper last ran with the gate open */
+    __u64 lifted_seq;   /* seq the watchdog lifted the gate for */
+};
+
+/* BPF map to share state with userspace */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct dumper_state);
+} dumper_state_map SEC(".maps");
+
+/*
+ * Last seq the dumper recorded, written by the dumper alone. The dumper
+ * never writes dumper_state back, so it cannot roll back a newer switch
+ * that happened while it was recording (e.g. after a watchdog gate lift).
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, __u64);
+} dumper_ack_map SEC(".maps");
+
+/* Sampling modes for stopping() */
+enum sample_mode {
+    SAMPLE_ALL,       /* Trace every switch (lockstep) */
+    SAMPLE_GLOBAL,    /* Trace 1 in sample_rate switches across all tasks */
+    SAMPLE_TID_HASH,  /* Trace every switch of 1 in sample_rate threads */
+};
+
+/*
+ * Load-time configuration (.rodata), set by scx_loader before load.
+ * Defaults match a plain lockstep run.
+ */
+const volatile bool trace_enabled = true;          /* false = no dumper gate (-m off) */
+const volatile __u32 trace_sample_mode = SAMPLE_ALL;  /* enum sample_mode */
+const volatile __u32 trace_sample_rate = 1;        /* N in "1 in N" */
+const volatile bool usersched_enabled = false;     /* Forward runnable tasks to scx_loader */
+const volatile __u64 usersched_timeout_ns = 100ULL * 1000000;  /* No heartbeat = stalled */
+const volatile __u64 slice_ns = SCX_SLICE_DFL;     /* Slice given to every task */
+const volatile bool debug_counters = true;         /* violations, dumper_runs, pending_empty */
+const volatile bool tiered_dsqs = true;            /* false = all tiers share SHARED_DSQ */
+const volatile bool companion_enabled = false;     /* Report non-ext switch-outs */
+const volatile s32 companion_cpu = -1;             /* CPU to watch, -1 = all */
+const volatile bool watchdog_enabled = true;       /* Lift stuck gates, age starving tasks */
+const volatile __u64 starve_thresh_ns = 250ULL * 1000000;  /* Longest tolerated wait */
+const volatile __u64 watchdog_interval_ns = 50ULL * 1000000;  /* Check period */
+const volatile bool cgroup_weights = false;        /* Share the normal tier by cpu.weight */
+
+/*
+ * Per-thread sampling rate overrides, key is tid. 0 = never trace,
+ * 1 = trace every switch, N = 1 in N. Pinned by scx_loader.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, 4096);
+    __type(key, __u32);
+    __type(value, __u32);
+} sample_rate_map SEC(".maps");
+
+/* Switch and sampling counters, per-CPU so switch-outs don't share a cache line */
+struct trace_stats {
+    __u64 nr_stops;     /* BENCH: switch-outs of non-dumper tasks, traced or not */
+    __u64 sampled_in;   /* Switches handed to the dumper */
+    __u64 sampled_out;  /* Switches skipped by sampling */
+    __u64 companion;    /* Non-ext switch-outs sent to userspace */
+    __u64 companion_dropped; /* Non-ext switch-outs lost to a full ring */
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct trace_stats);
+} trace_stats_map SEC(".maps");
+
+/*
+ * Tier membership: key is a tid or tgid, value is an enum latency_tier.
+ * A tid entry overrides the entry of its tgid. Pinned by scx_loader so
+ * scx_run --class can update it while the scheduler is running.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, 4096);
+    __type(key, __u32);
+    __type(value, __u32);
+} tier_map SEC(".maps");
+
+/*
+ * Per-tier runtime budgets. Budgets are wall-clock time of one CPU per
+ * period: a tier that used more than budget_ns of a CPU in the current
+ * period is only dispatched there when no lower tier has work.
+ */
+struct tier_state {
+    __u64 period_ns;              /* Budget accounting period (set by userspace) */
+    __u64 budget_ns[NR_TIERS];    /* Runtime allowed per CPU per period, 0 = unlimited */
+    __u64 total_ns[NR_TIERS];     /* STATS: runtime consumed since load, all CPUs */
+    __u64 throttled[NR_TIERS];    /* STATS: dispatches that skipped an over-budget tier */
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct tier_state);
+} tier_state_map SEC(".maps");
+
+/*
+ * Budget usage of the local CPU. Summing all CPUs against a one-CPU budget
+ * would throttle a tier busy on four CPUs after a quarter of the period.
+ */
+struct tier_usage {
+    __u64 period_start;           /* Start of this CPU's current period */
+    __u64 used_ns[NR_TIERS];      /* Runtime consumed on this CPU in the period */
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct tier_usage);
+} tier_usage_map SEC(".maps");
+
+/*
+ * Per-task scheduler metadata, classified once in init_task()/enable() so
+ * hot callbacks read only the task's own storage instead of global maps.
+ */
+struct task_ctx {
+    __u32 gen;          /* class_gen this classification was made under */
+    __u32 is_dumper;    /* Task is the registered dumper thread */
+    __u32 tier;         /* Effective latency tier */
+    __u32 fork_tier;    /* Tier inherited from the parent at fork */
+    __u32 trace_rate;   /* 0 = untraced, 1 = every switch, N = 1 in N */
+    __u32 nr_stops;     /* Switch-outs of this task, the 1-in-N counter */
+    __u64 enq_at;       /* Timestamp of last enqueue() */
+    __u64 run_at;       /* Timestamp of last running() */
+    __u32 in_user;      /* Forwarded to userspace, waiting for a decision */
+    __u64 user_seq;     /* Bumped per forward, decisions must echo it */
+    __u64 cgid;         /* Cgroup the task belongs to */
+    __u64 vtime;        /* Position among the tasks of its cgroup */
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, int);
+    __type(value, struct task_ctx);
+} task_ctx_map SEC(".maps");
+
+/*
+ * Classification generation. Anything that changes how tasks classify
+ * (dumper registration, tier_map or sample_rate_map updates) must bump
+ * it; tasks reclassify lazily on their next callback. Pinned by scx_loader.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, __u32);
+} class_gen_map SEC(".maps");
+
+/* BPF -> userspace: a runnable task to place */
+struct usersched_task {
+    __u32 pid;
+    __u32 tgid;
+    __s32 prev_cpu;
+    __u32 tier;
+    __u64 seq;          /* Echoed back in the decision */
+    __u64 enq_at;
+};
+
+/* Userspace -> BPF: where and in which order to run a task */
+struct usersched_decision {
+    __u32 pid;
+    __s32 cpu;          /* Target CPU, -1 = let the tier DSQs decide */
+    __u64 seq;          /* usersched_task.seq this answers */
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, 256 * 1024);
+} usersched_queue SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_USER_RINGBUF);
+    __uint(max_entries, 256 * 1024);
+} usersched_decisions SEC(".maps");
+
+/* Tasks waiting on userspace, pid -> enqueue time, for stall recovery */
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, 8192);
+    __type(key, __u32);
+    __type(value, __u64);
+} usersched_inflight SEC(".maps");
+
+/* Userspace liveness: CLOCK_MONOTONIC ns of the loader's last poll */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, __u64);
+} usersched_heartbeat SEC(".maps");
+
+struct usersched_stats {
+    __u64 inflight;         /* Forwarded and not yet decided */
+    __u64 forwarded;        /* Tasks sent to userspace */
+    __u64 dispatched;       /* Decisions applied */
+    __u64 stale;            /* Decisions for tasks no longer waiting */
+    __u64 fallback_full;    /* Ring or inflight map full, took tier path */
+    __u64 fallback_stalled; /* Userspace heartbeat too old, took tier path */
+    __u64 rescued;          /* In-flight tasks pulled back from a stalled userspace */
+    __u64 rtt_sum_ns;       /* enqueue -> decision applied */
+    __u64 rtt_max_ns;
+    __u64 nr_drains;        /* dispatch() calls that applied decisions */
+    __u64 drain_sum;        /* Decisions per drain */
+    __u64 drain_max;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct usersched_stats);
+} usersched_stats_map SEC(".maps");
+
+/* Class of a companion event, must match enum scx_event_class in scx_ring.h */
+enum event_class {
+    EV_EXT,
+    EV_FAIR,
+    EV_KTHREAD,
+    EV_RT,
+    EV_DL,
+    EV_IDLE,
+};
+
+/* A non-ext task gave up the watched CPU */
+struct companion_event {
+    __u64 ts_ns;        /* Switch-out time */
+    __u64 run_ns;       /* Time since the previous switch on this CPU */
+    __u32 tgid;
+    __u32 tid;
+    __u32 cls;          /* enum event_class */
+    __u32 cpu;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, 256 * 1024);
+} companion_events SEC(".maps");
+
+/* Timestamp of the last context switch on each CPU */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, __u64);
+} companion_last_switch SEC(".maps");
+
+/*
+ * Per-cgroup state, keyed by cgroup id. A hash rather than cgroup storage
+ * so dispatch() can scan it and scx_loader can read usage per cgroup.
+ * Pinned by scx_loader.
+ */
+#define CGRP_SELF_WEIGHT 100        /* A cgroup's runnable own tasks count as one default child */
+#define HWEIGHT_ONE (1ULL << 20)    /* hweight of the whole machine */
+#define MAX_CGRP_DEPTH 16
+#define CGRP_PICK_TRIES 4           /* Cgroups dispatch() tries before falling back */
+
+struct cgrp_ctx {
+    __u64 parent;           /* Parent cgroup id, 0 for the root */
+    __u64 dsq;              /* Vtime DSQ of the cgroup's own tasks */
+    __u32 weight;           /* cpu.weight, 1..10000, default 100 */
+    __u32 child_weight_sum; /* Sum of the active children's cpu.weight */
+    __u32 level;
+    __u32 hweight_gen;      /* cgrp_gen hweight/qweight were computed under */
+    __u32 nr_runnable;      /* Own tasks runnable in this scheduler */
+    __u32 nr_active;        /* Active children, plus one while nr_runnable */
+    __u64 hweight;          /* Share of the machine of the whole subtree */
+    __u64 qweight;          /* Share of the machine of the cgroup's own tasks */
+    __u64 cvtime;           /* Cgroup vtime: runtime scaled by 1 / qweight */
+    __u64 tvtime_now;       /* Highest task vtime started in this cgroup */
+    __u64 usage_ns;         /* STATS: runtime of member tasks */
+    __u64 nr_dispatched;    /* STATS: times dispatch() picked this cgroup */
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, 4096);
+    __type(key, __u64);
+    __type(value, struct cgrp_ctx);
+} cgrp_ctx_map SEC(".maps");
+
+/* Scheduler-wide cgroup state */
+struct cgrp_global {
+    __u32 gen;              /* Bumped when any weight or the hierarchy changes */
+    __u32 next_dsq;         /* Next free per-cgroup DSQ number */
+    __u64 cvtime_now;       /* cvtime of the last cgroup dispatched */
+    __u32 nr_untracked;     /* STATS: cgroups left out, cgrp_ctx_map was full */
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct cgrp_global);
+} cgrp_global_map SEC(".maps");
+
+/* Watchdog interventions, must match scx_loader.c */
+enum watchdog_action {
+    WD_GATE_LIFT,       /* Gate closed for too long, lifted it for that seq */
+    WD_AGE,             /* Moved a starving task to its CPU's local DSQ */
+};
+
+struct watchdog_event {
+    __u64 ts_ns;
+    __u64 wait_ns;      /* How long the gate was closed / the task waited */
+    __u32 action;       /* enum watchdog_action */
+    __u32 dsq;          /* DSQ the task waited in (DUMPER_DSQ for gate lifts) */
+    __u32 pid;          /* Aged task, or the task whose switch closed the gate */
+    __u32 cpu;
+};
+
+#define WATCHDOG_LOG_SIZE 64    /* Most recent interventions kept for the loader */
+#define WATCHDOG_AGE_MAX 32     /* Tasks aged per DSQ per check */
+#define WATCHDOG_SCAN_MAX 256   /* Tasks looked at per vtime DSQ per check */
+
+struct watchdog_state {
+    __u64 checks;
+    __u64 gate_lifts;
+    __u64 aged[NR_DSQS];
+    __u64 oldest_wait_ns[NR_DSQS];  /* Longest wait at the last check */
+    __u64 max_wait_ns[NR_DSQS];     /* Worst wait seen; cgroup DSQs count as shared */
+    __u64 nr_events;                /* Total interventions, log index */
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct watchdog_state);
+} watchdog_state_map SEC(".maps");
+
+/* Ring of the last WATCHDOG_LOG_SIZE interventions, indexed by nr_events */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, WATCHDOG_LOG_SIZE);
+    __type(key, __u32);
+    __type(value, struct watchdog_event);
+} watchdog_log SEC(".maps");
+
+struct watchdog_timer {
+    struct bpf_timer timer;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct watchdog_timer);
+} watchdog_timer_map SEC(".maps");
+
+/*
+ * Per-CPU time accounting from update_idle(), must match scx_loader.c.
+ * Busy covers every scheduling class, not only SCHED_EXT tasks. Gate idle
+ * is the part of idle_ns the CPU spent idle because dispatch() found the
+ * gate closed and DUMPER_DSQ empty while a task allowed on the CPU was
+ * queued, up to when the dumper reopened it.
+ */
+struct cpu_util {
+    __u64 busy_ns;
+    __u64 idle_ns;          /* Includes gate_idle_ns */
+    __u64 gate_idle_ns;
+    __u64 nr_idle;          /* Idle periods entered */
+    __u64 nr_gate_idle;     /* ... of which started with the gate closed */
+    __u64 nr_wake_idle;     /* Wakeups select_cpu() placed on an idle CPU */
+    __u64 nr_wake_busy;     /* Wakeups left on a busy prev_cpu */
+    __u64 last_ns;          /* Last accounted transition, 0 = none seen yet */
+    __u32 idle;             /* 1 while the CPU runs its idle task */
+    __u32 gate_idle;        /* The current idle period is charged to the gate */
+    __u32 gate_blocked;     /* dispatch() last found the gate closed with work held back */
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct cpu_util);
+} cpu_util_map SEC(".maps");
+
+/* kfunc declarations */
+extern void scx_bpf_dsq_insert(struct task_struct *p, u64 dsq_id, u64 slice, u64 enq_flags) __ksym;
+extern bool scx_bpf_dsq_move_to_local(u64 dsq_id) __ksym;
+extern s32 scx_bpf_create_dsq(u64 dsq_id, s32 node) __ksym;
+extern s32 scx_bpf_task_cpu(const struct task_struct *p) __ksym;
+extern void scx_bpf_kick_cpu(s32 cpu, u64 flags) __ksym;
+extern s32 scx_bpf_dsq_nr_queued(u64 dsq_id) __ksym;
+extern struct task_struct *bpf_task_from_pid(s32 pid) __ksym;
+extern void bpf_task_release(struct task_struct *p) __ksym;
+extern bool bpf_cpumask_test_cpu(u32 cpu, const struct cpumask *cpumask) __ksym;
+extern int bpf_iter_scx_dsq_new(struct bpf_iter_scx_dsq *it, u64 dsq_id, u64 flags) __ksym;
+extern struct task_struct *bpf_iter_scx_dsq_next(struct bpf_iter_scx_dsq *it) __ksym;
+extern void bpf_iter_scx_dsq_destroy(struct bpf_iter_scx_dsq *it) __ksym;
+extern bool scx_bpf_dsq_move(struct bpf_iter_scx_dsq *it, struct task_struct *p,
+                             u64 dsq_id, u64 enq_flags) __ksym;
+extern void scx_bpf_dsq_insert_vtime(struct task_struct *p, u64 dsq_id, u64 slice,
+                                     u64 vtime, u64 enq_flags) __ksym;
+extern void scx_bpf_destroy_dsq(u64 dsq_id) __ksym;
+extern bool scx_bpf_test_and_clear_cpu_idle(s32 cpu) __ksym;
+extern s32 scx_bpf_pick_idle_cpu(const struct cpumask *cpus_allowed, u64 flags) __ksym;
+
+/* Most decisions applied per dispatch(), the default dispatch buffer size */
+#define USERSCHED_DRAIN_MAX 32
+
+static __always_inline __u64 tier_dsq(__u32 tier)
+{
+    if (!tiered_dsqs)
+        return SHARED_DSQ;
+
+    switch (tier) {
+    case TIER_CRITICAL:
+        return CRITICAL_DSQ;
+    case TIER_BATCH:
+        return BATCH_DSQ;
+    default:
+        return SHARED_DSQ;
+    }
+}
+
+/* Look up a task's tier: tid entry first, then tgid, then fork default */
+static __always_inline __u32 task_tier(struct task_struct *p, __u32 dfl)
+{
+    __u32 id = p->pid;
+    __u32 *tier;
+
+    tier = bpf_map_lookup_elem(&tier_map, &id);
+    if (!tier) {
+        id = p->tgid;
+        tier = bpf_map_lookup_elem(&tier_map, &id);
+    }
+    if (tier && *tier < NR_TIERS)
+        return *tier;
+    return dfl;
+}
+
+/* Start a new budget period on this CPU once the current one has elapsed */
+static __always_inline void tier_roll_period(struct tier_state *ts, struct tier_usage *tu,
+                                             __u64 now)
+{
+    int i;
+
+    if (!ts->period_ns || now - tu->period_start < ts->period_ns)
+        return;
+
+    tu->period_start = now;
+    for (i = 0; i < NR_TIERS; i++)
+        tu->used_ns[i] = 0;
+}
+
+static __always_inline bool tier_over_budget(struct tier_state *ts, struct tier_usage *tu,
+                                             int tier)
+{
+    return ts->budget_ns[tier] && tu->used_ns[tier] >= ts->budget_ns[tier];
+}
+
+static __always_inline struct cgrp_global *cgrp_global(void)
+{
+    __u32 key = 0;
+
+    return bpf_map_lookup_elem(&cgrp_global_map, &key);
+}
+
+/*
+ * Machine share of a cgroup's own tasks, recomputed after any weight,
+ * hierarchy or activity change by walking up to the root. At each level
+ * the active children split the parent's share by cpu.weight, with the
+ * parent's own tasks counted as one more child of weight CGRP_SELF_WEIGHT
+ * while any of them is runnable. Idle siblings and an idle parent take
+ * nothing, as in scx_flatcg.
+ */
+static __always_inline __u64 cgrp_qweight(struct cgrp_ctx *cgc)
+{
+    struct cgrp_global *cg = cgrp_global();
+    struct cgrp_ctx *c = cgc, *parent;
+    __u64 hw = HWEIGHT_ONE;
+    __u32 gen = cg ? cg->gen : 0;
+    __u32 sum;
+    int i;
+
+    if (cgc->hweight_gen == gen && cgc->qweight)
+        return cgc->qweight;
+
+    for (i = 0; i < MAX_CGRP_DEPTH && c->parent; i++) {
+        parent = bpf_map_lookup_elem(&cgrp_ctx_map, &c->parent);
+        if (!parent)
+            break;
+        sum = parent->child_weight_sum + (parent->nr_runnable ? CGRP_SELF_WEIGHT : 0);
+        /* A racing (de)activation can leave sum short of our own weight */
+        if (sum > c->weight)
+            hw = hw * c->weight / sum;
+        c = parent;
+    }
+
+    cgc->hweight = hw;
+    cgc->qweight = hw * CGRP_SELF_WEIGHT / (cgc->child_weight_sum + CGRP_SELF_WEIGHT);
+    if (!cgc->qweight)
+        cgc->qweight = 1;
+    cgc->hweight_gen = gen;
+    return cgc->qweight;
+}
+
+static __always_inline void cgrp_bump_gen(void)
+{
+    struct cgrp_global *cg = cgrp_global();
+
+    if (cg)
+        __sync_fetch_and_add(&cg->gen, 1);
+}
+
+/*
+ * One of the cgroup's own tasks became runnable or quiescent. Only the
+ * first and the last walk up: a cgroup is active while it has runnable
+ * tasks or active children, and only active cgroups count in their
+ * parent's child_weight_sum. Lock-free, a racing pair of transitions
+ * cancels out in nr_active.
+ */
+static __always_inline void cgrp_update_active(__u64 cgid, bool runnable)
+{
+    struct cgrp_ctx *cgc, *parentc;
+    int i;
+
+    cgc = bpf_map_lookup_elem(&cgrp_ctx_map, &cgid);
+    if (!cgc)
+        return;
+
+    if (runnable) {
+        if (__sync_fetch_and_add(&cgc->nr_runnable, 1))
+            return;
+    } else {
+        if (__sync_fetch_and_sub(&cgc->nr_runnable, 1) != 1)
+            return;
+    }
+
+    for (i = 0; i < MAX_CGRP_DEPTH; i++) {
+        if (runnable) {
+            if (__sync_fetch_and_add(&cgc->nr_active, 1))
+                break;
+        } else {
+            if (__sync_fetch_and_sub(&cgc->nr_active, 1) != 1)
+                break;
+        }
+
+        /* cgc just became active or idle: so does its weight in the parent */
+        if (!cgc->parent)
+            break;
+        parentc = bpf_map_lookup_elem(&cgrp_ctx_map, &cgc->parent);
+        if (!parentc)
+            break;
+        if (runnable)
+            __sync_fetch_and_add(&parentc->child_weight_sum, cgc->weight);
+        else
+            __sync_fetch_and_sub(&parentc->child_weight_sum, cgc->weight);
+        cgc = parentc;
+    }
+    cgrp_bump_gen();
+}
+
+/*
+ * Queue p on its cgroup's vtime DSQ. Returns false if the cgroup is not
+ * known (yet), the caller then uses the plain tier DSQ.
+ */
+static __always_inline bool cgrp_enqueue(struct task_struct *p, struct task_ctx *taskc,
+                                         u64 enq_flags)
+{
+    struct cgrp_global *cg = cgrp_global();
+    struct cgrp_ctx *cgc;
+    __u64 min_vtime;
+
+    cgc = bpf_map_lookup_elem(&cgrp_ctx_map, &taskc->cgid);
+    if (!cgc || !cg)
+        return false;
+
+    /* A cgroup coming back from idle may not bank more than a slice of credit */
+    if (!scx_bpf_dsq_nr_queued(cgc->dsq) && (s64)(cgc->cvtime - (cg->cvtime_now - slice_ns)) < 0)
+        cgc->cvtime = cg->cvtime_now - slice_ns;
+
+    /* Same for a task that slept, within its cgroup */
+    min_vtime = cgc->tvtime_now - slice_ns;
+    if ((s64)(taskc->vtime - min_vtime) < 0)
+        taskc->vtime = min_vtime;
+
+    scx_bpf_dsq_insert_vtime(p, cgc->dsq, slice_ns, taskc->vtime, enq_flags);
+    return true;
+}
+
+struct cgrp_pick_ctx {
+    __u64 dsq;
+    __u64 cvtime;
+    struct cgrp_ctx *cgc;
+    __u64 after_dsq;        /* Only cgroups ordered after this one, 0 for all */
+    __u64 after_cvtime;
+};
+
+/* Cgroups are ordered by vtime, ties broken by DSQ id */
+static __always_inline bool cgrp_before(__u64 cvtime, __u64 dsq, __u64 cvtime2, __u64 dsq2)
+{
+    return (s64)(cvtime - cvtime2) < 0 || (cvtime == cvtime2 && dsq < dsq2);
+}
+
+/* bpf_for_each_map_elem() callback: remember the queued cgroup with the lowest vtime */
+static long cgrp_pick(struct bpf_map *map, __u64 *cgid, struct cgrp_ctx *cgc, void *data)
+{
+    struct cgrp_pick_ctx *pick = data;
+
+    if (!scx_bpf_dsq_nr_queued(cgc->dsq))
+        return 0;
+
+    if (pick->after_dsq &&
+        !cgrp_before(pick->after_cvtime, pick->after_dsq, cgc->cvtime, cgc->dsq))
+        return 0;
+
+    if (!pick->cgc || cgrp_before(cgc->cvtime, cgc->dsq, pick->cvtime, pick->dsq)) {
+        pick->dsq = cgc->dsq;
+        pick->cvtime = cgc->cvtime;
+        pick->cgc = cgc;
+    }
+    return 0;
+}
+
+/*
+ * Run the next task of the cgroup furthest behind its weighted share.
+ * Scans every known cgroup, fine for the tens to hundreds a host has.
+ * If another CPU drained the pick since the scan, the next-lowest cgroup
+ * is tried rather than leaving the normal tier to its plain DSQ.
+ */
+static __always_inline bool dispatch_cgroups(void)
+{
+    struct cgrp_global *cg = cgrp_global();
+    struct cgrp_pick_ctx pick = {};
+    int i;
+
+    for (i = 0; i < CGRP_PICK_TRIES; i++) {
+        pick.cgc = NULL;
+        bpf_for_each_map_elem(&cgrp_ctx_map, cgrp_pick, &pick, 0);
+        if (!pick.cgc)
+            return false;
+
+        if (scx_bpf_dsq_move_to_local(pick.dsq)) {
+            pick.cgc->nr_dispatched++;
+            if (cg)
+                cg->cvtime_now = pick.cvtime;
+            return true;
+        }
+
+        pick.after_dsq = pick.dsq;
+        pick.after_cvtime = pick.cvtime;
+    }
+    return false;
+}
+
+/* Charge the runtime that just ended to p's cgroup and to p within it */
+static __always_inline void cgrp_charge(struct task_struct *p, struct task_ctx *taskc,
+                                        __u64 delta)
+{
+    struct cgrp_ctx *cgc;
+
+    cgc = bpf_map_lookup_elem(&cgrp_ctx_map, &taskc->cgid);
+    if (!cgc)
+        return;
+
+    __sync_fetch_and_add(&cgc->usage_ns, delta);
+    cgc->cvtime += delta * HWEIGHT_ONE / cgrp_qweight(cgc);
+    taskc->vtime += delta * 100 / (p->scx.weight ?: 100);
+}
+
+/* Move the next task of a tier to the local DSQ */
+static __always_inline bool tier_move_to_local(int tier)
+{
+    if (cgroup_weights && tier == TIER_NORMAL && dispatch_cgroups())
+        return true;
+    return scx_bpf_dsq_move_to_local(tier_dsq(tier));
+}
+
+/*
+ * Consume from the tier DSQs in priority order. Tiers over budget are
+ * skipped on the first pass and only used if nothing else is runnable,
+ * so a busy high tier cannot starve lower ones but the CPU never idles
+ * while work is queued.
+ */
+static __always_inline void dispatch_tiers(void)
+{
+    __u32 key = 0;
+    struct tier_state *ts;
+    struct tier_usage *tu;
+    int i;
+
+    ts = tiered_dsqs ? bpf_map_lookup_elem(&tier_state_map, &key) : NULL;
+    tu = tiered_dsqs ? bpf_map_lookup_elem(&tier_usage_map, &key) : NULL;
+    if (!ts || !tu) {
+        /* Flat layout: every tier is "normal" */
+        tier_move_to_local(TIER_NORMAL);
+        return;
+    }
+
+    tier_roll_period(ts, tu, bpf_ktime_get_ns());
+
+    for (i = 0; i < NR_TIERS; i++) {
+        if (tier_over_budget(ts, tu, i)) {
+            if (scx_bpf_dsq_nr_queued(tier_dsq(i)))
+                __sync_fetch_and_add(&ts->throttled[i], 1);
+            continue;
+        }
+        if (tier_move_to_local(i))
+            return;
+    }
+
+    for (i = 0; i < NR_TIERS; i++) {
+        if (tier_over_budget(ts, tu, i) && tier_move_to_local(i))
+            return;
+    }
+}
+
+/* Multiplicative hash so consecutive tids spread across buckets */
+static __always_inline __u32 tid_hash(__u32 tid)
+{
+    return (tid * 2654435761U) >> 7;
+}
+
+/*
+ * Effective trace rate of a thread. SAMPLE_TID_HASH is resolved here to
+ * 0 or 1, so only SAMPLE_GLOBAL leaves per-switch work for stopping().
+ */
+static __always_inline __u32 task_trace_rate(__u32 tid)
+{
+    __u32 *override;
+    __u32 rate;
+
+    if (trace_sample_mode == SAMPLE_ALL)
+        return 1;
+
+    override = bpf_map_lookup_elem(&sample_rate_map, &tid);
+    rate = override ? *override : trace_sample_rate;
+    if (rate <= 1)
+        return rate;
+
+    if (trace_sample_mode == SAMPLE_TID_HASH)
+        return tid_hash(tid) % rate == 0;
+    return rate;
+}
+
+/*
+ * Decide whether this switch goes to the dumper. 1-in-N rates count the
+ * task's own switches: a shared counter aliases with periodic workloads
+ * (N threads round-robin on a CPU would be traced always or never).
+ */
+static __always_inline bool should_trace(struct task_ctx *taskc)
+{
+    if (taskc->trace_rate <= 1)
+        return taskc->trace_rate;
+    return ++taskc->nr_stops % taskc->trace_rate == 0;
+}
+
+/* Fill in everything derived from the global maps for task p */
+static __always_inline void classify_task(struct task_struct *p, struct task_ctx *taskc,
+                                          __u32 gen)
+{
+    __u32 key = 0;
+    struct dumper_state *state;
+    __u32 tid = p->pid;
+
+    state = bpf_map_lookup_elem(&dumper_state_map, &key);
+    taskc->is_dumper = state && state->dumper_tid != 0 && tid == state->dumper_tid;
+    taskc->tier = task_tier(p, taskc->fork_tier);
+    taskc->trace_rate = task_trace_rate(tid);
+    taskc->gen = gen;
+}
+
+/* Current classification generation, 0 if the map is unreadable */
+static __always_inline __u32 class_gen(void)
+{
+    __u32 key = 0;
+    __u32 *gen;
+
+    gen = bpf_map_lookup_elem(&class_gen_map, &key);
+    return gen ? *gen : 0;
+}
+
+/* Get p's task_ctx, reclassifying it first if the generation moved on */
+static __always_inline struct task_ctx *get_task_ctx(struct task_struct *p)
+{
+    struct task_ctx *taskc;
+    __u32 gen;
+
+    taskc = bpf_task_storage_get(&task_ctx_map, p, 0, 0);
+    if (!taskc)
+        return NULL;
+
+    gen = class_gen();
+    if (taskc->gen != gen)
+        classify_task(p, taskc, gen);
+    return taskc;
+}
+
+/* Userspace has not polled within the configured timeout */
+static __always_inline bool usersched_stalled(__u64 now)
+{
+    __u32 key = 0;
+    __u64 *hb;
+
+    hb = bpf_map_lookup_elem(&usersched_heartbeat, &key);
+    return !hb || now - *hb > usersched_timeout_ns;
+}
+
+/*
+ * Hand p to userspace. Returns false if it must be queued locally instead
+ * because userspace is stalled or the ring/inflight map is full.
+ */
+static __always_inline bool usersched_forward(struct task_struct *p, struct task_ctx *taskc)
+{
+    __u32 key = 0;
+    struct usersched_stats *st;
+    struct usersched_task *t;
+    __u32 pid = p->pid;
+    __u64 now = taskc->enq_at;
+
+    if (!usersched_enabled)
+        return false;
+
+    st = bpf_map_lookup_elem(&usersched_stats_map, &key);
+    if (!st)
+        return false;
+
+    if (usersched_stalled(now)) {
+        __sync_fetch_and_add(&st->fallback_stalled, 1);
+        return false;
+    }
+
+    t = bpf_ringbuf_reserve(&usersched_queue, sizeof(*t), 0);
+    if (!t) {
+        __sync_fetch_and_add(&st->fallback_full, 1);
+        return false;
+    }
+
+    if (bpf_map_update_elem(&usersched_inflight, &pid, &now, BPF_ANY)) {
+        bpf_ringbuf_discard(t, 0);
+        __sync_fetch_and_add(&st->fallback_full, 1);
+        return false;
+    }
+
+    taskc->in_user = 1;
+    taskc->user_seq++;
+
+    t->pid = pid;
+    t->tgid = p->tgid;
+    t->prev_cpu = scx_bpf_task_cpu(p);
+    t->tier = taskc->tier;
+    t->seq = taskc->user_seq;
+    t->enq_at = now;
+    bpf_ringbuf_submit(t, 0);
+
+    __sync_fetch_and_add(&st->inflight, 1);
+    __sync_fetch_and_add(&st->forwarded, 1);
+    return true;
+}
+
+/* p no longer waits on userspace (decided, rescued or dequeued) */
+static __always_inline void usersched_settle(struct task_ctx *taskc, __u32 pid,
+                                             struct usersched_stats *st)
+{
+    taskc->in_user = 0;
+    bpf_map_delete_elem(&usersched_inflight, &pid);
+    __sync_fetch_and_sub(&st->inflight, 1);
+}
+
+struct usersched_drain_ctx {
+    struct usersched_stats *st;
+    __s32 this_cpu;
+    __u32 nr;           /* Decisions consumed so far */
+    __u32 nr_local;     /* Decisions placed on this CPU's local DSQ */
+    __u32 max;          /* Stop after this many */
+    bool local_only;    /* Lockstep: other CPUs' local DSQs bypass the gate */
+    __u64 now;
+};
+
+/* bpf_user_ringbuf_drain() callback: apply one decision */
+static long usersched_apply(struct bpf_dynptr *dynptr, void *data)
+{
+    struct usersched_drain_ctx *dctx = data;
+    struct usersched_stats *st = dctx->st;
+    struct usersched_decision d;
+    struct task_struct *p;
+    struct task_ctx *taskc;
+    __u64 dsq, rtt;
+
+    if (bpf_dynptr_read(&d, sizeof(d), dynptr, 0, 0))
+        return 1;
+    dctx->nr++;
+
+    p = bpf_task_from_pid(d.pid);
+    if (!p) {
+        __sync_fetch_and_add(&st->stale, 1);
+        return dctx->nr >= dctx->max;
+    }
+
+    /* Only act on the answer to the task's latest forward */
+    taskc = bpf_task_storage_get(&task_ctx_map, p, 0, 0);
+    if (!taskc || !taskc->in_user || taskc->user_seq != d.seq) {
+        __sync_fetch_and_add(&st->stale, 1);
+        bpf_task_release(p);
+        return dctx->nr >= dctx->max;
+    }
+
+    usersched_settle(taskc, d.pid, st);
+
+    if (d.cpu >= 0 && bpf_cpumask_test_cpu(d.cpu, p->cpus_ptr) &&
+        (!dctx->local_only || d.cpu == dctx->this_cpu)) {
+        dsq = SCX_DSQ_LOCAL_ON | d.cpu;
+        if (d.cpu == dctx->this_cpu)
+            dctx->nr_local++;
+    } else {
+        dsq = tier_dsq(taskc->tier);
+    }
+    scx_bpf_dsq_insert(p, dsq, slice_ns, 0);
+
+    if (d.cpu >= 0 && d.cpu != dctx->this_cpu)
+        scx_bpf_kick_cpu(d.cpu, SCX_KICK_IDLE);
+
+    rtt = dctx->now - taskc->enq_at;
+    __sync_fetch_and_add(&st->rtt_sum_ns, rtt);
+    if (rtt > st->rtt_max_ns)
+        st->rtt_max_ns = rtt;
+    __sync_fetch_and_add(&st->dispatched, 1);
+
+    bpf_task_release(p);
+    return dctx->nr >= dctx->max;
+}
+
+struct usersched_rescue_ctx {
+    struct usersched_stats *st;
+    __u32 nr;
+    __u32 max;          /* Dispatch buffer slots the drain left */
+};
+
+/* bpf_for_each_map_elem() callback: requeue one in-flight task locally */
+static long usersched_rescue(struct bpf_map *map, __u32 *pid, __u64 *enq_at, void *data)
+{
+    struct usersched_rescue_ctx *rctx = data;
+    struct task_struct *p;
+    struct task_ctx *taskc;
+
+    p = bpf_task_from_pid(*pid);
+    if (!p) {
+        /* Task exited while in flight */
+        bpf_map_delete_elem(map, pid);
+        __sync_fetch_and_sub(&rctx->st->inflight, 1);
+        return 0;
+    }
+
+    taskc = bpf_task_storage_get(&task_ctx_map, p, 0, 0);
+    if (taskc && taskc->in_user) {
+        usersched_settle(taskc, *pid, rctx->st);
+        scx_bpf_dsq_insert(p, tier_dsq(taskc->tier), slice_ns, 0);
+        __sync_fetch_and_add(&rctx->st->rescued, 1);
+        rctx->nr++;
+    } else {
+        bpf_map_delete_elem(map, pid);
+    }
+
+    bpf_task_release(p);
+    return rctx->nr >= rctx->max;
+}
+
+/*
+ * Apply pending userspace decisions; if userspace stalled, pull in-flight
+ * tasks back into the tier DSQs so they cannot be stranded. When gated
+ * (lockstep with a dumper) only one decision is applied and only this
+ * CPU's local DSQ is used, since other CPUs run their local DSQs without
+ * going through the gate. Returns true if a task was placed on this CPU.
+ */
+static __always_inline bool dispatch_usersched(s32 cpu, bool gated)
+{
+    __u32 key = 0;
+    struct usersched_stats *st;
+    struct usersched_drain_ctx dctx = {};
+    struct usersched_rescue_ctx rctx = {};
+
+    if (!usersched_enabled)
+        return false;
+
+    st = bpf_map_lookup_elem(&usersched_stats_map, &key);
+    if (!st)
+        return false;
+
+    dctx.st = st;
+    dctx.this_cpu = cpu;
+    dctx.max = gated ? 1 : USERSCHED_DRAIN_MAX;
+    dctx.local_only = gated;
+    dctx.now = bpf_ktime_get_ns();
+    bpf_user_ringbuf_drain(&usersched_decisions, usersched_apply, &dctx, 0);
+    if (dctx.nr) {
+        __sync_fetch_and_add(&st->nr_drains, 1);
+        __sync_fetch_and_add(&st->drain_sum, dctx.nr);
+        if (dctx.nr > st->drain_max)
+            st->drain_max = dctx.nr;
+    }
+
+    /* Drain and rescue share one dispatch buffer of USERSCHED_DRAIN_MAX slots */
+    if (st->inflight && dctx.nr < USERSCHED_DRAIN_MAX && usersched_stalled(dctx.now)) {
+        rctx.st = st;
+        rctx.max = USERSCHED_DRAIN_MAX - dctx.nr;
+        bpf_for_each_map_elem(&usersched_inflight, usersched_rescue, &rctx, 0);
+    }
+
+    return dctx.nr_local > 0;
+}
+
+/* bpf_for_each_map_elem() callback: wake the CPU of a task stranded in flight */
+static long usersched_kick_stranded(struct bpf_map *map, __u32 *pid, __u64 *enq_at, void *data)
+{
+    __u32 *nr = data;
+    struct task_struct *p;
+
+    p = bpf_task_from_pid(*pid);
+    if (p) {
+        scx_bpf_kick_cpu(scx_bpf_task_cpu(p), SCX_KICK_IDLE);
+        bpf_task_release(p);
+    }
+    return ++*nr >= USERSCHED_DRAIN_MAX;
+}
+
+/*
+ * Userspace stalled with tasks in flight: only dispatch() can rescue them
+ * and idle CPUs don't call it, so wake the CPUs those tasks last ran on
+ */
+static __always_inline void usersched_check_stall(__u64 now)
+{
+    __u32 key = 0, nr = 0;
+    struct usersched_stats *st;
+
+    st = bpf_map_lookup_elem(&usersched_stats_map, &key);
+    if (st && st->inflight && usersched_stalled(now))
+        bpf_for_each_map_elem(&usersched_inflight, usersched_kick_stranded, &nr, 0);
+}
+
+/*
+ * Is the gate closed? It is for the current seq until the dumper acked it
+ * or the watchdog lifted it. A pure read: a store here could race with
+ * stopping() recording the next switch and open the gate for it.
+ */
+static __always_inline bool gate_closed(struct dumper_state *state)
+{
+    __u32 key = 0;
+    __u64 seq = state->seq;
+    __u64 *ack;
+
+    if (!state->pending || state->lifted_seq == seq)
+        return false;
+
+    ack = bpf_map_lookup_elem(&dumper_ack_map, &key);
+    return !ack || *ack != seq;
+}
+
+static __always_inline struct cpu_util *cpu_util(s32 cpu)
+{
+    __u32 key = 0;
+
+    return bpf_map_lookup_percpu_elem(&cpu_util_map, &key, cpu);
+}
+
+/* First time the dumper runs with the gate open since it closed: the gate ended */
+static __always_inline void gate_note_open(__u64 now)
+{
+    __u32 key = 0;
+    struct dumper_state *state;
+
+    state = bpf_map_lookup_elem(&dumper_state_map, &key);
+    if (!state || gate_closed(state))
+        return;
+
+    if (state->gate_opened < state->pending_since)
+        state->gate_opened = now;
+}
+
+/* Charge the time since the last transition to busy, idle or gate idle */
+static __always_inline void cpu_util_account(struct cpu_util *cu, __u64 now)
+{
+    __u32 key = 0;
+    struct dumper_state *state;
+    __u64 gate_end = now;
+
+    if (!cu->idle) {
+        cu->busy_ns += now - cu->last_ns;
+        return;
+    }
+
+    cu->idle_ns += now - cu->last_ns;
+    if (!cu->gate_idle)
+        return;
+
+    /* Once the gate is open again the rest of the idle period is real idleness */
+    state = bpf_map_lookup_elem(&dumper_state_map, &key);
+    if (state && !gate_closed(state)) {
+        gate_end = state->gate_opened;
+        if (gate_end < cu->last_ns)
+            gate_end = cu->last_ns;
+        else if (gate_end > now)
+            gate_end = now;
+        cu->gate_idle = 0;
+    }
+    cu->gate_idle_ns += gate_end - cu->last_ns;
+}
+
+/* Append an intervention to the log */
+static __always_inline void watchdog_record(struct watchdog_state *ws, __u32 action,
+                                            __u32 dsq, __u32 pid, __u32 cpu,
+                                            __u64 now, __u64 wait_ns)
+{
+    struct watchdog_event *ev;
+    __u32 idx;
+
+    idx = __sync_fetch_and_add(&ws->nr_events, 1) % WATCHDOG_LOG_SIZE;
+    ev = bpf_map_lookup_elem(&watchdog_log, &idx);
+    if (!ev)
+        return;
+
+    ev->ts_ns = now;
+    ev->wait_ns = wait_ns;
+    ev->action = action;
+    ev->dsq = dsq;
+    ev->pid = pid;
+    ev->cpu = cpu;
+}
+
+/* Gate closed longer than the threshold: the dumper is stuck or gone */
+static __always_inline void watchdog_check_gate(struct watchdog_state *ws, __u64 now)
+{
+    __u32 key = 0;
+    struct dumper_state *state;
+    __u64 wait, seq;
+
+    state = bpf_map_lookup_elem(&dumper_state_map, &key);
+    if (!state)
+        return;
+
+    seq = state->seq;
+    if (!gate_closed(state))
+        return;
+
+    wait = now - state->pending_since;
+    if (wait < starve_thresh_ns)
+        return;
+
+    /*
+     * The dumper still records the switch once it runs, only the order is
+     * lost. Only this seq is lifted: a switch recorded meanwhile has a new
+     * seq and keeps the gate closed until the dumper acks it.
+     */
+    state->lifted_seq = seq;
+    gate_note_open(now);
+    __sync_fetch_and_add(&ws->gate_lifts, 1);
+    watchdog_record(ws, WD_GATE_LIFT, DUMPER_DSQ, state->last_tid, state->last_cpu,
+                    now, wait);
+    scx_bpf_kick_cpu(state->last_cpu, 0);
+}
+
+/*
+ * Measure the longest wait in a DSQ and move tasks that waited past the
+ * threshold to the local DSQ of their CPU, where they run next. Counted
+ * under slot stat of watchdog_state. A tier DSQ is FIFO, so the scan stops
+ * at the first young task; a cgroup DSQ is in vtime order, where an old
+ * task may sit behind young ones, so up to WATCHDOG_SCAN_MAX are checked.
+ * Not done while the gate is closed: local DSQs are not gated, so aging
+ * would let tasks run ahead of the dumper. Lifting the gate comes first.
+ */
+static __always_inline void watchdog_check_dsq(struct watchdog_state *ws, __u64 dsq,
+                                               __u32 stat, __u64 now, bool gate_closed,
+                                               bool fifo)
+{
+    struct bpf_iter_scx_dsq it;
+    struct task_struct *p;
+    struct task_ctx *taskc;
+    __u64 wait;
+    __u32 nr = 0, scanned = 0;
+    s32 cpu;
+
+    if (stat >= NR_DSQS)
+        return;
+
+    bpf_iter_scx_dsq_new(&it, dsq, 0);
+    while ((p = bpf_iter_scx_dsq_next(&it))) {
+        if (!fifo && ++scanned > WATCHDOG_SCAN_MAX)
+            break;
+
+        taskc = bpf_task_storage_get(&task_ctx_map, p, 0, 0);
+        if (!taskc)
+            continue;
+
+        wait = now - taskc->enq_at;
+        if (wait > ws->oldest_wait_ns[stat])
+            ws->oldest_wait_ns[stat] = wait;
+        if (wait > ws->max_wait_ns[stat])
+            ws->max_wait_ns[stat] = wait;
 
-/* Define SCX constants */
-#define SCX_SLICE_DFL       (20ULL * 1000000)  /* 20ms default slice */
+        if (wait < starve_thresh_ns || gate_closed) {
+            /* FIFO: everything behind a young task is younger still */
+            if (fifo)
+                break;
+            continue;
+        }
 
-/* Enqueue flags */
-#define SCX_ENQ_WAKEUP      (1LLU << 0)
-#define SCX_ENQ_HEAD        (1LLU << 1)
+        cpu = scx_bpf_task_cpu(p);
+        if (scx_bpf_dsq_move(&it, p, SCX_DSQ_LOCAL_ON | cpu, 0)) {
+            __sync_fetch_and_add(&ws->aged[stat], 1);
+            watchdog_record(ws, WD_AGE, dsq, p->pid, cpu, now, wait);
+            scx_bpf_kick_cpu(cpu, 0);
+        }
 
-/* DSQ IDs - separate queues for dumper and other tasks */
-#define SHARED_DSQ 0    /* For regular tasks */
-#define DUMPER_DSQ 1    /* For dumper thread only */
+        if (++nr >= WATCHDOG_AGE_MAX)
+            break;
+    }
+    bpf_iter_scx_dsq_destroy(&it);
+}
+
+struct watchdog_cgrp_ctx {
+    struct watchdog_state *ws;
+    __u64 now;
+    bool gate_closed;
+};
+
+/* bpf_for_each_map_elem() callback: age the normal-tier tasks of one cgroup */
+static long watchdog_check_cgrp(struct bpf_map *map, __u64 *cgid, struct cgrp_ctx *cgc,
+                                void *data)
+{
+    struct watchdog_cgrp_ctx *wctx = data;
+
+    if (scx_bpf_dsq_nr_queued(cgc->dsq))
+        watchdog_check_dsq(wctx->ws, cgc->dsq, SHARED_DSQ, wctx->now, wctx->gate_closed,
+                           false);
+    return 0;
+}
 
 /*
- * Shared state between BPF and userspace dumper
+ * Periodic watchdog. A timer rather than ops.tick(), because tick only
+ * fires on CPUs running a task and a gated CPU may sit idle. Also runs
+ * without the watchdog in delegated mode, to catch a stalled loader.
  */
-struct dumper_state {
-    __u32 last_tgid;    /* Process ID of last switched-out task */
-    __u32 last_tid;     /* Thread ID of last switched-out task */
-    __u32 dumper_tid;   /* TID of dumper thread (set by userspace) */
-    __u64 seq;          /* Context switch sequence number */
-    __u32 pending;      /* 1 = dumper must run, 0 = others can run */
-    __u64 violations;   /* TEST: count times non-dumper ran while pending=1 */
-    __u64 dumper_runs;  /* TEST: count times dumper ran when pending=1 */
-    __u64 dispatch_pending_empty; /* DEBUG: dispatch called with pending=1 but DUMPER_DSQ empty */
-};
+static int watchdog_timerfn(void *map, int *key, struct watchdog_timer *wt)
+{
+    __u32 zero = 0;
+    struct watchdog_state *ws;
+    struct dumper_state *state;
+    bool closed = false;
+    __u64 now = bpf_ktime_get_ns();
 
-/* BPF map to share state with userspace */
-struct {
-    __uint(type, BPF_MAP_TYPE_ARRAY);
-    __uint(max_entries, 1);
-    __type(key, __u32);
-    __type(value, struct dumper_state);
-} dumper_state_map SEC(".maps");
+    if (usersched_enabled)
+        usersched_check_stall(now);
 
-/* kfunc declarations */
-extern void scx_bpf_dsq_insert(struct task_struct *p, u64 dsq_id, u64 slice, u64 enq_flags) __ksym;
-extern bool scx_bpf_dsq_move_to_local(u64 dsq_id) __ksym;
-extern s32 scx_bpf_create_dsq(u64 dsq_id, s32 node) __ksym;
-extern s32 scx_bpf_task_cpu(const struct task_struct *p) __ksym;
-extern void scx_bpf_kick_cpu(s32 cpu, u64 flags) __ksym;
+    ws = watchdog_enabled ? bpf_map_lookup_elem(&watchdog_state_map, &zero) : NULL;
+    if (ws) {
+        ws->checks++;
+
+        if (trace_enabled) {
+            watchdog_check_gate(ws, now);
+            state = bpf_map_lookup_elem(&dumper_state_map, &zero);
+            closed = state && gate_closed(state);
+        }
+
+        __builtin_memset(ws->oldest_wait_ns, 0, sizeof(ws->oldest_wait_ns));
+        watchdog_check_dsq(ws, SHARED_DSQ, SHARED_DSQ, now, closed, true);
+        if (tiered_dsqs) {
+            watchdog_check_dsq(ws, CRITICAL_DSQ, CRITICAL_DSQ, now, closed, true);
+            watchdog_check_dsq(ws, BATCH_DSQ, BATCH_DSQ, now, closed, true);
+        }
+        if (cgroup_weights) {
+            struct watchdog_cgrp_ctx wctx = { .ws = ws, .now = now, .gate_closed = closed };
+
+            bpf_for_each_map_elem(&cgrp_ctx_map, watchdog_check_cgrp, &wctx, 0);
+        }
+    }
+
+    bpf_timer_start(&wt->timer, watchdog_interval_ns, 0);
+    return 0;
+}
 
 /*
  * select_cpu - select a CPU for a waking task
- * Just return the previously used CPU
+ * Keep prev_cpu if it is idle (cache-warm), otherwise wake an idle CPU the
+ * task may run on, or stay on prev_cpu if there is none
  */
 SEC("struct_ops/select_cpu")
 s32 BPF_PROG(select_cpu, struct task_struct *p, s32 prev_cpu, u64 wake_flags)
 {
-    return prev_cpu;
+    struct cpu_util *cu;
+    s32 cpu = prev_cpu;
+    bool idle;
+
+    idle = scx_bpf_test_and_clear_cpu_idle(prev_cpu);
+    if (!idle && p->nr_cpus_allowed > 1) {
+        cpu = scx_bpf_pick_idle_cpu(p->cpus_ptr, 0);
+        idle = cpu >= 0;
+        if (!idle)
+            cpu = prev_cpu;
+    }
+
+    cu = cpu_util(cpu);
+    if (cu) {
+        if (idle)
+            __sync_fetch_and_add(&cu->nr_wake_idle, 1);
+        else
+            __sync_fetch_and_add(&cu->nr_wake_busy, 1);
+    }
+    return cpu;
 }
 
 /*
  * enqueue - enqueue a task to be scheduled
- * Dumper goes to DUMPER_DSQ, others go to SHARED_DSQ
+ * Dumper goes to DUMPER_DSQ, others go to userspace in delegated mode or
+ * to the DSQ of their latency tier
  */
 SEC("struct_ops/enqueue")
 void BPF_PROG(enqueue, struct task_struct *p, u64 enq_flags)
 {
-    __u32 key = 0;
-    struct dumper_state *state;
-    __u32 tid = p->pid;  /* In kernel, pid is actually TID */
+    struct task_ctx *taskc;
 
-    state = bpf_map_lookup_elem(&dumper_state_map, &key);
-    if (!state) {
-        scx_bpf_dsq_insert(p, SHARED_DSQ, SCX_SLICE_DFL, enq_flags);
+    taskc = get_task_ctx(p);
+    if (!taskc) {
+        scx_bpf_dsq_insert(p, SHARED_DSQ, slice_ns, enq_flags);
         return;
     }
 
-    if (state->dumper_tid != 0 && tid == state->dumper_tid) {
+    taskc->enq_at = bpf_ktime_get_ns();
+
+    if (taskc->is_dumper) {
         /* Dumper goes to its own DSQ */
-        scx_bpf_dsq_insert(p, DUMPER_DSQ, SCX_SLICE_DFL, enq_flags);
+        scx_bpf_dsq_insert(p, DUMPER_DSQ, slice_ns, enq_flags);
+    } else if (usersched_forward(p, taskc)) {
+        /* Userspace decides; task stays in BPF custody until dispatch() */
+        return;
+    } else if (cgroup_weights && tier_dsq(taskc->tier) == SHARED_DSQ &&
+               cgrp_enqueue(p, taskc, enq_flags)) {
+        /* Normal tier: queued in its cgroup, weighted by cpu.weight */
+        return;
     } else {
-        /* Regular tasks go to shared DSQ */
-        scx_bpf_dsq_insert(p, SHARED_DSQ, SCX_SLICE_DFL, enq_flags);
+        /* Regular tasks go to their tier's DSQ */
+        scx_bpf_dsq_insert(p, tier_dsq(taskc->tier), slice_ns, enq_flags);
     }
 }
 
 /*
  * running - called when a task starts running on CPU
- * Used to detect violations: non-dumper running while pending=1
+ * Records the start of the task's run for tier accounting and detects
+ * violations: non-dumper running while pending=1
  */
 SEC("struct_ops/running")
 void BPF_PROG(running, struct task_struct *p)
 {
     __u32 key = 0;
     struct dumper_state *state;
-    __u32 tid = p->pid;
+    struct task_ctx *taskc;
+
+    taskc = get_task_ctx(p);
+    if (!taskc)
+        return;
+
+    /* Remember when we started so stopping() can charge the tier */
+    taskc->run_at = bpf_ktime_get_ns();
+
+    /* Advance the cgroup's task clock, sleepers are clamped against it */
+    if (cgroup_weights) {
+        struct cgrp_ctx *cgc = bpf_map_lookup_elem(&cgrp_ctx_map, &taskc->cgid);
+
+        if (cgc && (s64)(taskc->vtime - cgc->tvtime_now) > 0)
+            cgc->tvtime_now = taskc->vtime;
+    }
+
+    if (!trace_enabled || !debug_counters)
+        return;
 
     state = bpf_map_lookup_elem(&dumper_state_map, &key);
     if (!state)
@@ -109,8 +1490,8 @@ void BPF_PROG(running, struct task_struct *p)
     if (state->dumper_tid == 0)
         return;
 
-    if (state->pending == 1) {
-        if (tid == state->dumper_tid) {
+    if (gate_closed(state)) {
+        if (taskc->is_dumper) {
             /* Good: dumper is running while pending=1 */
             state->dumper_runs++;
         } else {
@@ -122,73 +1503,565 @@ void BPF_PROG(running, struct task_struct *p)
 
 /*
  * stopping - called when a task is being switched out
- * Update state for dumper synchronization
+ * Charge tier runtime and update state for dumper synchronization
  */
 SEC("struct_ops/stopping")
 void BPF_PROG(stopping, struct task_struct *p, bool runnable)
 {
     __u32 key = 0;
     struct dumper_state *state;
+    struct task_ctx *taskc;
+    struct tier_state *ts;
+    struct tier_usage *tu;
+    struct trace_stats *stats;
     __u32 tid = p->pid;   /* In kernel, pid is actually TID */
     __u32 tgid = p->tgid; /* Process ID */
+    __u64 delta = 0;
     s32 cpu;
 
-    state = bpf_map_lookup_elem(&dumper_state_map, &key);
-    if (!state)
+    taskc = get_task_ctx(p);
+    if (!taskc)
+        return;
+
+    /* The dumper is not charged to a tier and its switches are not tracked */
+    if (taskc->is_dumper) {
+        if (trace_enabled)
+            gate_note_open(bpf_ktime_get_ns());
+        return;
+    }
+
+    /* Charge the runtime that just ended to the task's tier and cgroup */
+    if (tiered_dsqs || cgroup_weights)
+        delta = bpf_ktime_get_ns() - taskc->run_at;
+    if (tiered_dsqs) {
+        /* Flat layout has no budgets, so no shared tier_state traffic either */
+        ts = bpf_map_lookup_elem(&tier_state_map, &key);
+        tu = bpf_map_lookup_elem(&tier_usage_map, &key);
+        if (ts && tu && taskc->tier < NR_TIERS) {
+            /* stopping() runs on the CPU the task ran on */
+            tu->used_ns[taskc->tier] += delta;
+            __sync_fetch_and_add(&ts->total_ns[taskc->tier], delta);
+        }
+    }
+    if (cgroup_weights)
+        cgrp_charge(p, taskc, delta);
+
+    /* Count every switch-out so untraced runs have a comparable rate */
+    stats = bpf_map_lookup_elem(&trace_stats_map, &key);
+    if (!stats)
+        return;
+    stats->nr_stops++;
+
+    /* Tracing off: stay clear of the shared dumper state */
+    if (!trace_enabled)
         return;
 
     /* Skip if no dumper registered yet */
-    if (state->dumper_tid == 0)
+    state = bpf_map_lookup_elem(&dumper_state_map, &key);
+    if (!state || state->dumper_tid == 0)
         return;
 
-    /* Skip if this is the dumper thread - don't track dumper's own switches */
-    if (tid == state->dumper_tid)
+    /* Skip switches not selected by sampling, but count them for scaling */
+    if (!should_trace(taskc)) {
+        stats->sampled_out++;
         return;
+    }
+    stats->sampled_in++;
 
     /* Update state: save task info, increment seq, set pending */
+    cpu = scx_bpf_task_cpu(p);
     state->last_tgid = tgid;
     state->last_tid = tid;
+    state->last_cpu = cpu;
     state->seq++;
+    state->pending_since = bpf_ktime_get_ns();
     state->pending = 1;
 
     /* Kick CPU to wake dumper */
-    cpu = scx_bpf_task_cpu(p);
     scx_bpf_kick_cpu(cpu, 0);
 }
 
+#define GATE_SCAN_MAX 64    /* Queued tasks gate_held_work() looks at per DSQ */
+
+struct gate_work_ctx {
+    s32 cpu;
+    bool found;
+};
+
+/* Is a task queued in dsq allowed on cpu? Looks at the first GATE_SCAN_MAX */
+static __always_inline bool dsq_has_work_for(__u64 dsq, s32 cpu)
+{
+    struct bpf_iter_scx_dsq it;
+    struct task_struct *p;
+    bool found = false;
+    __u32 nr = 0;
+
+    if (!scx_bpf_dsq_nr_queued(dsq))
+        return false;
+
+    bpf_iter_scx_dsq_new(&it, dsq, 0);
+    while ((p = bpf_iter_scx_dsq_next(&it))) {
+        if (bpf_cpumask_test_cpu(cpu, p->cpus_ptr)) {
+            found = true;
+            break;
+        }
+        if (++nr >= GATE_SCAN_MAX)
+            break;
+    }
+    bpf_iter_scx_dsq_destroy(&it);
+    return found;
+}
+
+/* bpf_for_each_map_elem() callback: stop at the first cgroup with work for the CPU */
+static long cgrp_has_work_for(struct bpf_map *map, __u64 *cgid, struct cgrp_ctx *cgc,
+                              void *data)
+{
+    struct gate_work_ctx *gw = data;
+
+    if (!dsq_has_work_for(cgc->dsq, gw->cpu))
+        return 0;
+    gw->found = true;
+    return 1;
+}
+
+/* bpf_for_each_map_elem() callback: stop at the first in-flight task allowed on the CPU */
+static long usersched_has_work_for(struct bpf_map *map, __u32 *pid, __u64 *enq_at, void *data)
+{
+    struct gate_work_ctx *gw = data;
+    struct task_struct *p;
+
+    p = bpf_task_from_pid(*pid);
+    if (!p)
+        return 0;
+    gw->found = bpf_cpumask_test_cpu(gw->cpu, p->cpus_ptr);
+    bpf_task_release(p);
+    return gw->found;
+}
+
+/*
+ * Did the gate keep work from this CPU? True if a task this CPU may run is
+ * queued where dispatch() looks with the gate open: the tier DSQs, the
+ * cgroup DSQs or the tasks waiting on a userspace decision. Tasks pinned
+ * elsewhere (e.g. the traced ones under taskset) do not count, so CPUs
+ * that could never have run them are not charged with gate idle.
+ */
+static __always_inline bool gate_held_work(s32 cpu)
+{
+    struct gate_work_ctx gw = { .cpu = cpu };
+    __u32 key = 0;
+    struct usersched_stats *st;
+
+    if (dsq_has_work_for(SHARED_DSQ, cpu))
+        return true;
+    if (tiered_dsqs &&
+        (dsq_has_work_for(CRITICAL_DSQ, cpu) || dsq_has_work_for(BATCH_DSQ, cpu)))
+        return true;
+    if (usersched_enabled) {
+        st = bpf_map_lookup_elem(&usersched_stats_map, &key);
+        if (st && st->inflight)
+            bpf_for_each_map_elem(&usersched_inflight, usersched_has_work_for, &gw, 0);
+        if (gw.found)
+            return true;
+    }
+    if (cgroup_weights)
+        bpf_for_each_map_elem(&cgrp_ctx_map, cgrp_has_work_for, &gw, 0);
+    return gw.found;
+}
+
 /*
  * dispatch - dispatch tasks to a CPU
- * If pending=1, only dumper can run. Otherwise, dispatch normally.
+ * If pending=1, only dumper can run. Otherwise, dispatch by tier.
  */
 SEC("struct_ops/dispatch")
 void BPF_PROG(dispatch, s32 cpu, struct task_struct *prev)
 {
     __u32 key = 0;
     struct dumper_state *state;
+    struct cpu_util *cu;
+    bool blocked = false;
+
+    /* No dumper, no gate */
+    if (!trace_enabled) {
+        if (!dispatch_usersched(cpu, false))
+            dispatch_tiers();
+        return;
+    }
 
     state = bpf_map_lookup_elem(&dumper_state_map, &key);
     if (!state) {
         /* Fallback if map lookup fails */
-        scx_bpf_dsq_move_to_local(SHARED_DSQ);
+        dispatch_tiers();
         return;
     }
 
-    if (state->pending == 1) {
+    if (gate_closed(state)) {
         /* Only dumper can run - consume only from DUMPER_DSQ */
-        if (!scx_bpf_dsq_move_to_local(DUMPER_DSQ)) {
+        blocked = !scx_bpf_dsq_move_to_local(DUMPER_DSQ);
+        if (blocked && debug_counters) {
             /* DUMPER_DSQ is empty while pending=1 - this causes violations */
             state->dispatch_pending_empty++;
         }
+        /* Idling with nothing queued is not the gate's doing */
+        blocked = blocked && gate_held_work(cpu);
     } else {
-        /* Normal operation - try dumper first, then shared */
-        if (!scx_bpf_dsq_move_to_local(DUMPER_DSQ))
-            scx_bpf_dsq_move_to_local(SHARED_DSQ);
+        /* Normal operation - try dumper first, then userspace decisions, then the tiers */
+        if (!scx_bpf_dsq_move_to_local(DUMPER_DSQ) &&
+            !dispatch_usersched(cpu, state->dumper_tid != 0))
+            dispatch_tiers();
+    }
+
+    /* If the CPU goes idle now, update_idle() charges it to the gate */
+    cu = cpu_util(cpu);
+    if (cu)
+        cu->gate_blocked = blocked;
+}
+
+/*
+ * update_idle - CPU enters or leaves its idle task
+ * Close the busy or idle period that just ended. An idle period entered
+ * right after dispatch() was held back by the gate is charged to the gate.
+ */
+SEC("struct_ops/update_idle")
+void BPF_PROG(update_idle, s32 cpu, bool idle)
+{
+    struct cpu_util *cu;
+    __u64 now = bpf_ktime_get_ns();
+
+    cu = cpu_util(cpu);
+    if (!cu)
+        return;
+
+    if (cu->last_ns)
+        cpu_util_account(cu, now);
+
+    if (idle && !cu->idle) {
+        cu->nr_idle++;
+        cu->gate_idle = trace_enabled && cu->gate_blocked;
+        if (cu->gate_idle)
+            cu->nr_gate_idle++;
+    } else if (!idle) {
+        cu->gate_idle = 0;
+    }
+    cu->idle = idle;
+    cu->last_ns = now;
+}
+
+/*
+ * dequeue - task leaves BPF custody without being dispatched by us
+ * Forget a pending userspace decision so it is treated as stale
+ */
+SEC("struct_ops/dequeue")
+void BPF_PROG(dequeue, struct task_struct *p, u64 deq_flags)
+{
+    __u32 key = 0;
+    struct task_ctx *taskc;
+    struct usersched_stats *st;
+
+    taskc = bpf_task_storage_get(&task_ctx_map, p, 0, 0);
+    if (!taskc || !taskc->in_user)
+        return;
+
+    st = bpf_map_lookup_elem(&usersched_stats_map, &key);
+    if (st)
+        usersched_settle(taskc, p->pid, st);
+}
+
+/*
+ * runnable - p woke up or was created, before enqueue()
+ * Its cgroup becomes active and takes its cpu.weight share
+ */
+SEC("struct_ops/runnable")
+void BPF_PROG(runnable, struct task_struct *p, u64 enq_flags)
+{
+    struct task_ctx *taskc;
+
+    if (!cgroup_weights)
+        return;
+
+    taskc = bpf_task_storage_get(&task_ctx_map, p, 0, 0);
+    if (taskc)
+        cgrp_update_active(taskc->cgid, true);
+}
+
+/*
+ * quiescent - p went to sleep or is leaving the scheduler
+ * The last one out returns its cgroup's share to the active siblings
+ */
+SEC("struct_ops/quiescent")
+void BPF_PROG(quiescent, struct task_struct *p, u64 deq_flags)
+{
+    struct task_ctx *taskc;
+
+    if (!cgroup_weights)
+        return;
+
+    taskc = bpf_task_storage_get(&task_ctx_map, p, 0, 0);
+    if (taskc)
+        cgrp_update_active(taskc->cgid, false);
+}
+
+static __always_inline __u32 task_event_class(struct task_struct *p)
+{
+    if (p->pid == 0)
+        return EV_IDLE;
+
+    switch (p->policy) {
+    case SCHED_EXT:
+        return EV_EXT;
+    case SCHED_FIFO:
+    case SCHED_RR:
+        return EV_RT;
+    case SCHED_DEADLINE:
+        return EV_DL;
+    default:
+        return (p->flags & PF_KTHREAD) ? EV_KTHREAD : EV_FAIR;
+    }
+}
+
+/*
+ * companion_switch - every context switch, on any scheduling class
+ * Reports the outgoing task if it is not ours; SCHED_EXT switch-outs are
+ * already traced through stopping() and the dumper. Not loaded unless
+ * companion tracing is enabled.
+ */
+SEC("tp_btf/sched_switch")
+int BPF_PROG(companion_switch, bool preempt, struct task_struct *prev,
+             struct task_struct *next, unsigned int prev_state)
+{
+    __u32 key = 0;
+    struct companion_event *e;
+    struct trace_stats *stats;
+    __u64 *last, now, run_ns;
+    __u32 cpu, cls;
+
+    if (!companion_enabled)
+        return 0;
+
+    cpu = bpf_get_smp_processor_id();
+    if (companion_cpu >= 0 && cpu != companion_cpu)
+        return 0;
+
+    last = bpf_map_lookup_elem(&companion_last_switch, &key);
+    if (!last)
+        return 0;
+    now = bpf_ktime_get_ns();
+    run_ns = *last ? now - *last : 0;
+    *last = now;
+
+    cls = task_event_class(prev);
+    if (cls == EV_EXT)
+        return 0;
+
+    stats = bpf_map_lookup_elem(&trace_stats_map, &key);
+    e = bpf_ringbuf_reserve(&companion_events, sizeof(*e), 0);
+    if (!e) {
+        if (stats)
+            stats->companion_dropped++;
+        return 0;
+    }
+
+    e->ts_ns = now;
+    e->run_ns = run_ns;
+    e->tgid = prev->tgid;
+    e->tid = prev->pid;
+    e->cls = cls;
+    e->cpu = cpu;
+    bpf_ringbuf_submit(e, 0);
+
+    if (stats)
+        stats->companion++;
+    return 0;
+}
+
+/*
+ * usersched_kick - wake an idle CPU so it drains new userspace decisions
+ * Run by scx_loader via BPF_PROG_TEST_RUN after submitting a batch
+ */
+struct usersched_kick_args {
+    __s32 cpu;
+};
+
+SEC("syscall")
+int usersched_kick(struct usersched_kick_args *args)
+{
+    scx_bpf_kick_cpu(args->cpu, SCX_KICK_IDLE);
+    return 0;
+}
+
+/*
+ * init_task - a task is joining the scheduler's view (load or fork)
+ * Create its task_ctx; a forked task inherits its parent's tier
+ */
+SEC("struct_ops/init_task")
+s32 BPF_PROG(init_task, struct task_struct *p, struct scx_init_task_args *args)
+{
+    struct task_ctx *taskc, *parentc;
+    struct task_struct *parent;
+
+    taskc = bpf_task_storage_get(&task_ctx_map, p, 0, BPF_LOCAL_STORAGE_GET_F_CREATE);
+    if (!taskc)
+        return -ENOMEM;
+
+    taskc->cgid = args->cgroup ? args->cgroup->kn->id : 0;
+    taskc->fork_tier = TIER_NORMAL;
+    if (args->fork) {
+        /* init_task runs in the context of the forking task */
+        parent = bpf_get_current_task_btf();
+        parentc = bpf_task_storage_get(&task_ctx_map, parent, 0, 0);
+        if (parentc)
+            taskc->fork_tier = parentc->tier;
+    }
+
+    classify_task(p, taskc, class_gen());
+    return 0;
+}
+
+/*
+ * enable - task switched to SCHED_EXT
+ * Refresh the classification, e.g. after the policy change of the dumper
+ */
+SEC("struct_ops/enable")
+void BPF_PROG(enable, struct task_struct *p)
+{
+    struct task_ctx *taskc;
+
+    taskc = bpf_task_storage_get(&task_ctx_map, p, 0, 0);
+    if (taskc)
+        classify_task(p, taskc, class_gen());
+}
+
+/*
+ * exit_task - task is leaving the scheduler's view
+ */
+SEC("struct_ops/exit_task")
+void BPF_PROG(exit_task, struct task_struct *p, struct scx_exit_task_args *args)
+{
+    bpf_task_storage_delete(&task_ctx_map, p);
+}
+
+/* Arm the starvation watchdog */
+static __always_inline s32 watchdog_start(void)
+{
+    __u32 key = 0;
+    struct watchdog_timer *wt;
+    s32 err;
+
+    wt = bpf_map_lookup_elem(&watchdog_timer_map, &key);
+    if (!wt)
+        return -ENOMEM;
+
+    err = bpf_timer_init(&wt->timer, &watchdog_timer_map, CLOCK_MONOTONIC);
+    if (err)
+        return err;
+    err = bpf_timer_set_callback(&wt->timer, watchdog_timerfn);
+    if (err)
+        return err;
+    return bpf_timer_start(&wt->timer, watchdog_interval_ns, 0);
+}
+
+/*
+ * cgroup_init - a cgroup appears (or exists at load), parents first
+ * Give it a vtime DSQ; its weight counts in the parent once it is active.
+ * Past cgrp_ctx_map's capacity the cgroup is left untracked instead of
+ * failing its creation: cgrp_enqueue() does not find it, so its tasks
+ * use the plain normal-tier DSQ.
+ */
+SEC("struct_ops.s/cgroup_init")
+s32 BPF_PROG(cgroup_init, struct cgroup *cgrp, struct scx_cgroup_init_args *args)
+{
+    struct cgrp_global *cg = cgrp_global();
+    struct cgrp_ctx cgc = {};
+    __u64 cgid = cgrp->kn->id;
+
+    /* Only registered without -G if libbpf could not leave it out */
+    if (!cgroup_weights)
+        return 0;
+    if (!cg)
+        return -ENOMEM;
+
+    cgc.parent = cgrp->self.parent ? cgrp->self.parent->cgroup->kn->id : 0;
+    cgc.dsq = CGRP_DSQ_BASE + __sync_fetch_and_add(&cg->next_dsq, 1);
+    cgc.weight = args->weight;
+    cgc.level = cgrp->level;
+    cgc.cvtime = cg->cvtime_now;
+
+    if (!scx_bpf_create_dsq(cgc.dsq, -1)) {
+        if (!bpf_map_update_elem(&cgrp_ctx_map, &cgid, &cgc, BPF_ANY))
+            return 0;
+        scx_bpf_destroy_dsq(cgc.dsq);
     }
+
+    __sync_fetch_and_add(&cg->nr_untracked, 1);
+    return 0;
+}
+
+/*
+ * cgroup_exit - a cgroup is removed (or the scheduler unloads)
+ */
+SEC("struct_ops/cgroup_exit")
+void BPF_PROG(cgroup_exit, struct cgroup *cgrp)
+{
+    struct cgrp_ctx *cgc, *parentc;
+    __u64 cgid = cgrp->kn->id;
+
+    cgc = bpf_map_lookup_elem(&cgrp_ctx_map, &cgid);
+    if (!cgc)
+        return;
+
+    parentc = bpf_map_lookup_elem(&cgrp_ctx_map, &cgc->parent);
+    if (parentc && cgc->nr_active)
+        __sync_fetch_and_sub(&parentc->child_weight_sum, cgc->weight);
+
+    scx_bpf_destroy_dsq(cgc->dsq);
+    bpf_map_delete_elem(&cgrp_ctx_map, &cgid);
+    cgrp_bump_gen();
+}
+
+/*
+ * cgroup_move - p migrates between cgroups (called while p is dequeued)
+ * Start it at the destination's task clock so it neither jumps nor waits
+ */
+SEC("struct_ops/cgroup_move")
+void BPF_PROG(cgroup_move, struct task_struct *p, struct cgroup *from, struct cgroup *to)
+{
+    struct task_ctx *taskc;
+    struct cgrp_ctx *cgc;
+
+    taskc = bpf_task_storage_get(&task_ctx_map, p, 0, 0);
+    if (!taskc)
+        return;
+
+    taskc->cgid = to->kn->id;
+    cgc = bpf_map_lookup_elem(&cgrp_ctx_map, &taskc->cgid);
+    if (cgc)
+        taskc->vtime = cgc->tvtime_now;
+}
+
+/*
+ * cgroup_set_weight - cpu.weight was written
+ */
+SEC("struct_ops/cgroup_set_weight")
+void BPF_PROG(cgroup_set_weight, struct cgroup *cgrp, u32 weight)
+{
+    struct cgrp_ctx *cgc, *parentc;
+    __u64 cgid = cgrp->kn->id;
+
+    cgc = bpf_map_lookup_elem(&cgrp_ctx_map, &cgid);
+    if (!cgc)
+        return;
+
+    /* An idle cgroup is not in its parent's sum, the new weight counts once active */
+    parentc = bpf_map_lookup_elem(&cgrp_ctx_map, &cgc->parent);
+    if (parentc && cgc->nr_active)
+        __sync_fetch_and_add(&parentc->child_weight_sum, weight - cgc->weight);
+    cgc->weight = weight;
+    cgrp_bump_gen();
 }
 
 /*
  * init - scheduler initialization
- * Create both dispatch queues
+ * Create the dumper DSQ and one DSQ per latency tier, start the watchdog
+ * timer (also needed in delegated mode)
  */
 SEC("struct_ops.s/init")
 s32 BPF_PROG(init)
@@ -205,6 +2078,19 @@ s32 BPF_PROG(init)
     if (err)
         return err;
 
+    /* Create DSQs for the critical and batch tiers */
+    if (tiered_dsqs) {
+        err = scx_bpf_create_dsq(CRITICAL_DSQ, -1);
+        if (err)
+            return err;
+
+        err = scx_bpf_create_dsq(BATCH_DSQ, -1);
+        if (err)
+            return err;
+    }
+
+    if (watchdog_enabled || usersched_enabled)
+        return watchdog_start();
     return 0;
 }
 
@@ -219,20 +2105,37 @@ void BPF_PROG(sched_exit, struct scx_exit_info *ei)
 }
 
 /*
+ * SCX_OPS_KEEP_BUILTIN_IDLE (1) = keep the kernel's idle tracking, which
+ *   implementing update_idle() would otherwise turn off; select_cpu() uses it
  * SCX_OPS_SWITCH_PARTIAL (8) = only opted-in tasks use this scheduler
+ * SCX_OPS_HAS_CGROUP_WEIGHT (1 << 16) = cpu.weight is implemented
  */
+#define SCX_OPS_KEEP_BUILTIN_IDLE 1ULL
 #define SCX_OPS_SWITCH_PARTIAL 8ULL
+#define SCX_OPS_HAS_CGROUP_WEIGHT (1ULL << 16)
 
 /* Define the scheduler ops structure */
 SEC(".struct_ops")
 struct sched_ext_ops scheduler_ops = {
     .select_cpu     = (void *)select_cpu,
     .enqueue        = (void *)enqueue,
+    .dequeue        = (void *)dequeue,
     .dispatch       = (void *)dispatch,
+    .runnable       = (void *)runnable,
     .running        = (void *)running,
     .stopping       = (void *)stopping,
+    .quiescent      = (void *)quiescent,
+    .update_idle    = (void *)update_idle,
+    .init_task      = (void *)init_task,
+    .exit_task      = (void *)exit_task,
+    .enable         = (void *)enable,
+    .cgroup_init    = (void *)cgroup_init,
+    .cgroup_exit    = (void *)cgroup_exit,
+    .cgroup_move    = (void *)cgroup_move,
+    .cgroup_set_weight = (void *)cgroup_set_weight,
     .init           = (void *)init,
     .exit           = (void *)sched_exit,
-    .flags          = SCX_OPS_SWITCH_PARTIAL,
+    .flags          = SCX_OPS_KEEP_BUILTIN_IDLE | SCX_OPS_SWITCH_PARTIAL |
+                      SCX_OPS_HAS_CGROUP_WEIGHT,
     .name           = "scheduler",
 };
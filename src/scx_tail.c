@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * scx_tail - follow the event stream published by scx_loader -s
+ *
+ * Prints events in X.txt format ("seq tgid tid") as they arrive. Any
+ * number of scx_tail instances can run at once; a slow one only loses
+ * events for itself. With -k, non-ext events published by scx_loader -k
+ * are shown too, with their class, CPU and run time.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "scx_ring.h"
+
+#define IDLE_SPINS 1000     /* Empty polls before backing off to sleep */
+
+static volatile sig_atomic_t running = 1;
+
+static void sigint_handler(int sig)
+{
+    (void)sig;
+    running = 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s <name>] [-a] [-t] [-k]\n", prog);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -s <name>  Shared-memory ring name (default: %s)\n", SCX_RING_DEFAULT_NAME);
+    fprintf(stderr, "  -a         Start from the oldest event still in the ring\n");
+    fprintf(stderr, "  -t         Also print the publish timestamp (ns)\n");
+    fprintf(stderr, "  -k         Include non-ext tasks: \"seq tgid tid class cpu run_ns\"\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = SCX_RING_DEFAULT_NAME;
+    struct scx_ring_reader reader;
+    struct scx_event ev;
+    unsigned long nr_read = 0;
+    uint64_t reported_lost = 0;
+    int from_oldest = 0;
+    int show_ts = 0;
+    int show_all = 0;
+    int idle = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:athk")) != -1) {
+        switch (opt) {
+        case 's':
+            name = optarg;
+            break;
+        case 'a':
+            from_oldest = 1;
+            break;
+        case 't':
+            show_ts = 1;
+            break;
+        case 'k':
+            show_all = 1;
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if (scx_ring_reader_open(&reader, name, from_oldest)) {
+        fprintf(stderr, "Failed to open ring %s: %s\n", name, strerror(errno));
+        fprintf(stderr, "Is scx_loader running with -s?\n");
+        return 1;
+    }
+
+    signal(SIGINT, sigint_handler);
+    signal(SIGTERM, sigint_handler);
+
+    while (running) {
+        if (!scx_ring_read(&reader, &ev)) {
+            /* Caught up - spin briefly, then sleep so we don't burn a CPU */
+            if (++idle > IDLE_SPINS) {
+                fflush(stdout);
+                usleep(1000);
+            }
+            continue;
+        }
+        idle = 0;
+        nr_read++;
+
+        if (reader.lost != reported_lost) {
+            fprintf(stderr, "scx_tail: lost %llu events (reader too slow)\n",
+                    (unsigned long long)(reader.lost - reported_lost));
+            reported_lost = reader.lost;
+        }
+
+        /* Without -k keep the output identical to X.txt */
+        if (ev.cls != SCX_EV_EXT && !show_all)
+            continue;
+
+        printf("%llu %u %u", (unsigned long long)ev.seq, ev.tgid, ev.tid);
+        if (show_all)
+            printf(" %s %u %llu", ev.cls < SCX_EV_NR_CLASSES ? scx_event_class_names[ev.cls] : "?",
+                   ev.cpu, (unsigned long long)ev.run_ns);
+        if (show_ts)
+            printf(" %llu", (unsigned long long)ev.ts_ns);
+        printf("\n");
+    }
+
+    fflush(stdout);
+    fprintf(stderr, "scx_tail: read %lu events, lost %llu\n", nr_read,
+            (unsigned long long)reader.lost);
+    scx_ring_reader_close(&reader);
+    return 0;
+}
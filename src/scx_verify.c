@@ -0,0 +1,327 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * scx_verify - live X/Y check while the scheduler and workload run
+ *
+ * Streaming form of the offline "every Y entry appears in X in order"
+ * check. Follows the dumper's ring (scx_loader -s) and process_tree's ring
+ * (process_tree --publish) with one cursor each. Every Y record must be
+ * matched by a later X entry with the same (tgid, tid); X entries in
+ * between are extra switch-outs and are skipped.
+ *
+ * Only the X entries after the last match are kept, at most <window> of
+ * them, so memory does not grow with the run. A Y record with no match in
+ * a full window is a mismatch and is reported with context right away;
+ * the oldest half of the window is then dropped so the check resyncs even
+ * when the window filled with X entries that have no Y counterpart.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include "scx_ring.h"
+
+#define IDLE_SPINS 1000         /* Empty polls before backing off to sleep */
+#define DEFAULT_WINDOW 4096     /* X entries kept while looking for a match */
+#define NR_HISTORY 8            /* Matched pairs shown as mismatch context */
+#define NR_CONTEXT 8            /* Unmatched X entries shown as mismatch context */
+
+/* X entries read but not yet matched, oldest first */
+struct x_window {
+    struct scx_event *ev;
+    size_t cap;
+    size_t head;
+    size_t len;
+    size_t scanned;             /* Entries already compared with the current Y */
+};
+
+struct match {
+    struct scx_event y;
+    struct scx_event x;
+};
+
+static volatile sig_atomic_t running = 1;
+
+static struct match history[NR_HISTORY];
+static unsigned long nr_history;
+static unsigned long y_read, matched, mismatches, x_read, x_extra;
+
+static void sigint_handler(int sig)
+{
+    (void)sig;
+    running = 0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct scx_event *x_at(struct x_window *w, size_t i)
+{
+    return &w->ev[(w->head + i) % w->cap];
+}
+
+static void x_push(struct x_window *w, const struct scx_event *ev)
+{
+    *x_at(w, w->len) = *ev;
+    w->len++;
+}
+
+static void x_drop(struct x_window *w, size_t n)
+{
+    w->head = (w->head + n) % w->cap;
+    w->len -= n;
+}
+
+/* Next traced switch-out from the X ring, skipping companion (non-ext) events */
+static int read_x(struct scx_ring_reader *r, struct scx_event *ev)
+{
+    while (scx_ring_read(r, ev)) {
+        if (ev->cls == SCX_EV_EXT)
+            return 1;
+    }
+    return 0;
+}
+
+/* Open a ring, waiting for its producer to create it */
+static int open_ring(struct scx_ring_reader *r, const char *name, int from_oldest)
+{
+    int waited = 0;
+
+    while (running) {
+        if (scx_ring_reader_open(r, name, from_oldest) == 0)
+            return 0;
+        if (errno != ENOENT) {
+            fprintf(stderr, "Failed to open ring %s: %s\n", name, strerror(errno));
+            return -1;
+        }
+        if (!waited++)
+            fprintf(stderr, "Waiting for /dev/shm/%s...\n", name);
+        usleep(100000);
+    }
+    return -1;
+}
+
+static void print_event(const char *prefix, const struct scx_event *ev)
+{
+    printf("%s seq %llu tgid %u tid %u\n", prefix, (unsigned long long)ev->seq,
+           ev->tgid, ev->tid);
+}
+
+/* Report a Y record that found no X entry within the window */
+static void report_mismatch(const struct scx_event *y, struct x_window *w)
+{
+    unsigned long i, first;
+
+    printf("\n");
+    printf("MISMATCH #%lu: Y seq %llu (tgid %u tid %u) not in the next %zu X entries\n",
+           mismatches, (unsigned long long)y->seq, y->tgid, y->tid, w->len);
+
+    first = nr_history > NR_HISTORY ? nr_history - NR_HISTORY : 0;
+    printf("  Last matches (Y -> X):\n");
+    for (i = first; i < nr_history; i++) {
+        const struct match *m = &history[i % NR_HISTORY];
+
+        printf("    Y %llu -> X %llu  (tgid %u tid %u)\n", (unsigned long long)m->y.seq,
+               (unsigned long long)m->x.seq, m->y.tgid, m->y.tid);
+    }
+
+    printf("  X after the last match:\n");
+    for (i = 0; i < w->len && i < NR_CONTEXT; i++)
+        print_event("   ", x_at(w, i));
+    if (w->len > NR_CONTEXT)
+        printf("    ... %zu more\n", w->len - NR_CONTEXT);
+    printf("\n");
+    fflush(stdout);
+}
+
+static void report_progress(double elapsed, struct scx_ring_reader *xr,
+                            struct scx_ring_reader *yr, struct x_window *w,
+                            const struct scx_event *y, int have_y)
+{
+    printf("[%7.1fs] Y %lu matched %lu (%.2f%%) extra X %lu mismatches %lu | "
+           "lag X %llu Y %llu, oldest Y %.1f ms | window %zu/%zu | lost X %llu Y %llu\n",
+           elapsed, y_read, matched, y_read ? 100.0 * matched / y_read : 100.0,
+           x_extra, mismatches,
+           (unsigned long long)(scx_ring_lag(xr) + w->len),
+           (unsigned long long)(scx_ring_lag(yr) + have_y),
+           have_y ? (now_ns() - y->ts_ns) / 1e6 : 0.0,
+           w->len, w->cap,
+           (unsigned long long)xr->lost, (unsigned long long)yr->lost);
+    fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-x <name>] [-y <name>] [-w <entries>] [-i <sec>] [-a] [-e]\n", prog);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -x <name>     X ring from scx_loader -s (default: %s)\n", SCX_RING_DEFAULT_NAME);
+    fprintf(stderr, "  -y <name>     Y ring from process_tree --publish (default: %s)\n", SCX_RING_Y_NAME);
+    fprintf(stderr, "  -w <entries>  Unmatched X entries kept per Y record (default: %d)\n", DEFAULT_WINDOW);
+    fprintf(stderr, "  -i <sec>      Progress report interval (default: 1)\n");
+    fprintf(stderr, "  -a            Start X from the oldest event still in its ring\n");
+    fprintf(stderr, "  -e            Exit on the first mismatch\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Start it before process_tree; lockstep tracing only (sampled X is partial).\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *x_name = SCX_RING_DEFAULT_NAME;
+    const char *y_name = SCX_RING_Y_NAME;
+    struct scx_ring_reader xr = {0}, yr = {0};
+    struct x_window w = {0};
+    struct scx_event y, x;
+    size_t window = DEFAULT_WINDOW;
+    double interval = 1.0;
+    int x_from_oldest = 0;
+    int exit_on_mismatch = 0;
+    int have_y = 0;
+    int idle = 0;
+    uint64_t start, last_report;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "x:y:w:i:aeh")) != -1) {
+        switch (opt) {
+        case 'x':
+            x_name = optarg;
+            break;
+        case 'y':
+            y_name = optarg;
+            break;
+        case 'w':
+            window = strtoul(optarg, NULL, 0);
+            if (window == 0) {
+                fprintf(stderr, "Invalid window: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'i':
+            interval = atof(optarg);
+            if (interval <= 0) {
+                fprintf(stderr, "Invalid interval: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'a':
+            x_from_oldest = 1;
+            break;
+        case 'e':
+            exit_on_mismatch = 1;
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    signal(SIGINT, sigint_handler);
+    signal(SIGTERM, sigint_handler);
+
+    w.cap = window;
+    w.ev = calloc(w.cap, sizeof(*w.ev));
+    if (!w.ev) {
+        fprintf(stderr, "Failed to allocate window of %zu entries\n", window);
+        return 1;
+    }
+
+    /* X first, so no switch-out of the workload is missed; Y from its start */
+    if (open_ring(&xr, x_name, x_from_oldest) || open_ring(&yr, y_name, 1)) {
+        free(w.ev);
+        scx_ring_reader_close(&xr);
+        return 1;
+    }
+    printf("Verifying /dev/shm/%s (Y) against /dev/shm/%s (X), window %zu\n",
+           y_name, x_name, window);
+
+    start = last_report = now_ns();
+    while (running) {
+        int progress = 0;
+
+        if (!have_y && scx_ring_read(&yr, &y)) {
+            have_y = 1;
+            w.scanned = 0;
+            y_read++;
+            progress = 1;
+        }
+
+        if (have_y) {
+            /* Compare only the X entries this Y has not seen yet */
+            while (w.scanned < w.len) {
+                const struct scx_event *cand = x_at(&w, w.scanned);
+
+                if (cand->tgid == y.tgid && cand->tid == y.tid)
+                    break;
+                w.scanned++;
+            }
+
+            if (w.scanned < w.len) {
+                struct match *m = &history[nr_history++ % NR_HISTORY];
+
+                m->y = y;
+                m->x = *x_at(&w, w.scanned);
+                x_extra += w.scanned;
+                x_drop(&w, w.scanned + 1);
+                matched++;
+                have_y = 0;
+                progress = 1;
+            } else if (w.len == w.cap) {
+                size_t slide = (w.len + 1) / 2;
+
+                mismatches++;
+                report_mismatch(&y, &w);
+                /* Keep the newer half: the next Y may still match there */
+                x_extra += slide;
+                x_drop(&w, slide);
+                have_y = 0;
+                progress = 1;
+                if (exit_on_mismatch)
+                    break;
+            } else if (read_x(&xr, &x)) {
+                x_push(&w, &x);
+                x_read++;
+                progress = 1;
+            }
+        }
+
+        if ((now_ns() - last_report) / 1e9 >= interval) {
+            last_report = now_ns();
+            report_progress((last_report - start) / 1e9, &xr, &yr, &w, &y, have_y);
+        }
+
+        if (progress) {
+            idle = 0;
+        } else if (++idle > IDLE_SPINS) {
+            /* Both streams caught up - sleep so we don't burn a CPU */
+            usleep(1000);
+        }
+    }
+
+    report_progress((now_ns() - start) / 1e9, &xr, &yr, &w, &y, have_y);
+    printf("\n");
+    printf("Y records read:    %lu\n", y_read);
+    printf("Y matched in X:    %lu\n", matched);
+    printf("X entries read:    %lu (%lu extra)\n", x_read, x_extra);
+    printf("Mismatches:        %lu\n", mismatches);
+    if (xr.lost || yr.lost)
+        printf("INCONCLUSIVE: verifier fell behind, lost X %llu Y %llu\n",
+               (unsigned long long)xr.lost, (unsigned long long)yr.lost);
+    else if (mismatches)
+        printf("FAILED: %lu Y records not found in X in order\n", mismatches);
+    else
+        printf("PASSED: every Y record appears in X in order\n");
+
+    free(w.ev);
+    scx_ring_reader_close(&xr);
+    scx_ring_reader_close(&yr);
+    return mismatches || xr.lost || yr.lost;
+}